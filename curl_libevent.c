@@ -25,13 +25,19 @@
 #define xfree	curl_libevent_xfree
 
 #ifndef _WIN32
+#include <sys/socket.h>
 #include <err.h>
+#include <errno.h>
+#include <pthread.h>
 #include <unistd.h>
 #define curl_libevent_xfree	free
 #endif
 #include <event.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 
 #include <curl/curl.h>
 
@@ -43,10 +49,19 @@ void		 xfree(void *);
 /* curl glue */
 static void	 curl_libevent_on_event(int, short, void *);
 static void	 curl_libevent_on_timer(int, short, void *);
+static void	 curl_libevent_on_drain(int, short, void *);
 static void	 curl_libevent_events(struct curl_libevent *);
+static void	 curl_libevent_drain(struct curl_libevent *);
 static int	 curl_libevent_set_events(CURL *, curl_socket_t, int, void *,
 		    void *);
 static int	 curl_libevent_set_timer(CURLM *, long , void *);
+static void	 curl_libevent_promote(struct curl_libevent *);
+static void	 curl_libevent_reject(struct curl_libevent *, CURL *,
+		    void (*)(void *, CURLMsg *), bool);
+static int	 curl_libevent_perform_internal(struct curl_libevent *, CURL *,
+		    void (*)(void *, CURLMsg *),
+		    const struct curl_libevent_attr *, const char *const *,
+		    unsigned, unsigned);
 
 #ifdef _WIN32
 static void	 curl_libevent_winhttp_callback(HINTERNET, DWORD_PTR, DWORD,
@@ -57,6 +72,295 @@ static void	 warnx(const char *, ...);
 static void	 vwarnx(const char *, va_list);
 #endif
 
+/* threads */
+#ifdef _WIN32
+typedef HANDLE			 curl_libevent_thread_t;
+typedef CRITICAL_SECTION	 curl_libevent_mutex_t;
+#define CURL_LIBEVENT_THREAD_FUNC	DWORD WINAPI
+#define THREAD_CREATE(_t, _f, _a)				\
+	((*(_t) = CreateThread(NULL, 0, (_f), (_a), 0, NULL)) != NULL	\
+	    ? 0 : -1)
+#define THREAD_JOIN(_t)						\
+	do {							\
+		WaitForSingleObject((_t), INFINITE);		\
+		CloseHandle(_t);				\
+	} while (0/* CONSTCOND */)
+#define MUTEX_INIT(_m)		InitializeCriticalSection(_m)
+#define MUTEX_DESTROY(_m)	DeleteCriticalSection(_m)
+#define MUTEX_LOCK(_m)		EnterCriticalSection(_m)
+#define MUTEX_UNLOCK(_m)	LeaveCriticalSection(_m)
+#define ATOMIC_ADD(_p, _v)					\
+	((unsigned)InterlockedExchangeAdd((volatile LONG *)(_p), (_v)))
+#define ATOMIC_LOAD(_p)						\
+	((unsigned)InterlockedCompareExchange((volatile LONG *)(_p), 0, 0))
+#define ATOMIC_XCHG(_p, _v)					\
+	((unsigned)InterlockedExchange((volatile LONG *)(_p), (_v)))
+#define ATOMIC_CAS(_p, _o, _n)					\
+	((unsigned)InterlockedCompareExchange((volatile LONG *)(_p),	\
+	    (_n), (_o)) == (_o))
+#define ATOMIC_LOAD_PTR(_p)					\
+	InterlockedCompareExchangePointer((PVOID volatile *)(_p), NULL, NULL)
+#define ATOMIC_STORE_PTR(_p, _v)				\
+	((void)InterlockedExchangePointer((PVOID volatile *)(_p), (_v)))
+#define ATOMIC_XCHG_PTR(_p, _v)					\
+	InterlockedExchangePointer((PVOID volatile *)(_p), (_v))
+#define CURL_LIBEVENT_TLS	__declspec(thread)
+#define SOCKET_WOULDBLOCK()	(WSAGetLastError() == WSAEWOULDBLOCK)
+#else
+typedef pthread_t		 curl_libevent_thread_t;
+typedef pthread_mutex_t		 curl_libevent_mutex_t;
+#define CURL_LIBEVENT_THREAD_FUNC	void *
+#define THREAD_CREATE(_t, _f, _a)	pthread_create((_t), NULL, (_f), (_a))
+#define THREAD_JOIN(_t)		pthread_join((_t), NULL)
+#define MUTEX_INIT(_m)		pthread_mutex_init((_m), NULL)
+#define MUTEX_DESTROY(_m)	pthread_mutex_destroy(_m)
+#define MUTEX_LOCK(_m)		pthread_mutex_lock(_m)
+#define MUTEX_UNLOCK(_m)	pthread_mutex_unlock(_m)
+/* returns the previous value */
+#define ATOMIC_ADD(_p, _v)	__atomic_fetch_add((_p), (_v), __ATOMIC_SEQ_CST)
+#define ATOMIC_LOAD(_p)		__atomic_load_n((_p), __ATOMIC_SEQ_CST)
+#define ATOMIC_XCHG(_p, _v)	__atomic_exchange_n((_p), (_v), __ATOMIC_SEQ_CST)
+#define ATOMIC_CAS(_p, _o, _n)	__sync_bool_compare_and_swap((_p), (_o), (_n))
+#define ATOMIC_LOAD_PTR(_p)	__atomic_load_n((_p), __ATOMIC_SEQ_CST)
+#define ATOMIC_STORE_PTR(_p, _v)				\
+	__atomic_store_n((_p), (_v), __ATOMIC_SEQ_CST)
+#define ATOMIC_XCHG_PTR(_p, _v)					\
+	__atomic_exchange_n((_p), (_v), __ATOMIC_SEQ_CST)
+#define CURL_LIBEVENT_TLS	__thread
+#define SOCKET_WOULDBLOCK()	(errno == EAGAIN || errno == EWOULDBLOCK)
+#endif
+
+/* the index of the lowest set bit */
+#ifdef _WIN32
+#define CTZ64(_x)		curl_libevent_ctz64(_x)
+static __inline int
+curl_libevent_ctz64(uint64_t x)
+{
+	unsigned long	 idx;
+
+	_BitScanForward64(&idx, x);
+	return ((int)idx);
+}
+#else
+#define CTZ64(_x)		__builtin_ctzll(_x)
+#endif
+
+/* cross-thread submission */
+struct curl_libevent_submission;
+static void	 curl_libevent_submit_internal(struct curl_libevent *, CURL *,
+		    void (*)(void *, CURLMsg *), bool);
+static void	 curl_libevent_on_submit(evutil_socket_t, short, void *);
+static void	 curl_libevent_subq_push(struct curl_libevent *,
+		    struct curl_libevent_submission *);
+static struct curl_libevent_submission
+		*curl_libevent_subq_pop(struct curl_libevent *);
+
+/* batched completions */
+struct curl_libevent_body;
+static void	 curl_libevent_batch_add(struct curl_libevent *, void *, CURL *,
+		    CURLcode, struct curl_libevent_body *);
+static void	 curl_libevent_batch_flush(struct curl_libevent *);
+static void	 curl_libevent_on_batch(int, short, void *);
+
+/* completion executor */
+struct curl_libevent_job;
+struct curl_libevent_jobq;
+static void	 curl_libevent_executor_push(struct curl_libevent *, void *,
+		    void (*)(void *, CURLMsg *), CURLMsg *, CURL *,
+		    struct curl_libevent_body *);
+static void	 curl_libevent_executor_stop(struct curl_libevent *);
+static CURL_LIBEVENT_THREAD_FUNC
+		 curl_libevent_executor_main(void *);
+static void	 curl_libevent_executor_on_done(evutil_socket_t, short,
+		    void *);
+static void	 curl_libevent_job_run(struct curl_libevent_job *);
+static void	 curl_libevent_job_free(struct curl_libevent *,
+		    struct curl_libevent_job *);
+static void	 curl_libevent_jobq_init(struct curl_libevent_jobq *);
+static void	 curl_libevent_jobq_push(struct curl_libevent_jobq *,
+		    struct curl_libevent_job *);
+static struct curl_libevent_job
+		*curl_libevent_jobq_pop(struct curl_libevent_jobq *);
+/* the job whose on_done the worker is running */
+static CURL_LIBEVENT_TLS struct curl_libevent_job
+		*curl_libevent_job_current;
+
+/* tenants */
+struct curl_libevent_curl;
+struct curl_libevent_tenant;
+static struct curl_libevent_tenant
+		*curl_libevent_tenant_get(struct curl_libevent *, unsigned);
+static void	 curl_libevent_tenant_put(struct curl_libevent *,
+		    struct curl_libevent_tenant *);
+static void	 curl_libevent_tenant_enqueue(struct curl_libevent *,
+		    struct curl_libevent_curl *);
+static struct curl_libevent_curl
+		*curl_libevent_tenant_dequeue(struct curl_libevent *);
+
+/* rate limiter */
+struct curl_libevent_bucket;
+static struct curl_libevent_bucket
+		*curl_libevent_bucket_get(struct curl_libevent *, const char *,
+		    bool);
+static bool	 curl_libevent_ratelimit(struct curl_libevent *,
+		    struct curl_libevent_curl *, const char *);
+static void	 curl_libevent_bucket_free(struct curl_libevent *,
+		    struct curl_libevent_bucket *);
+static void	 curl_libevent_bucket_refill(struct curl_libevent_bucket *);
+static void	 curl_libevent_bucket_arm(struct curl_libevent_bucket *);
+static void	 curl_libevent_bucket_on_timer(int, short, void *);
+
+/* bandwidth shaping */
+static void	 curl_libevent_shaper_add(struct curl_libevent *,
+		    struct curl_libevent_curl *);
+static void	 curl_libevent_shaper_remove(struct curl_libevent *,
+		    struct curl_libevent_curl *);
+static size_t	 curl_libevent_shaper_write(char *, size_t, size_t, void *);
+static size_t	 curl_libevent_shaper_read(char *, size_t, size_t, void *);
+static void	 curl_libevent_on_shaper(int, short, void *);
+static void	 curl_libevent_shaper_resume(struct curl_libevent *);
+
+/* deadlines */
+static void	 curl_libevent_now(struct curl_libevent *, struct timeval *);
+static uint64_t	 curl_libevent_wheel_ticks(struct curl_libevent *);
+static void	 curl_libevent_wheel_insert(struct curl_libevent *,
+		    struct curl_libevent_curl *);
+static void	 curl_libevent_wheel_place(struct curl_libevent *,
+		    struct curl_libevent_curl *);
+static void	 curl_libevent_wheel_remove(struct curl_libevent *,
+		    struct curl_libevent_curl *);
+static void	 curl_libevent_wheel_arm(struct curl_libevent *);
+static void	 curl_libevent_on_wheel(int, short, void *);
+
+/* response bodies */
+struct curl_libevent_body;
+static void	 curl_libevent_buffer(struct curl_libevent_curl *);
+static struct curl_libevent_body
+		*curl_libevent_body_ref(struct curl_libevent_body *);
+static void	 curl_libevent_body_unref(struct curl_libevent_body *);
+static size_t	 curl_libevent_body_write(char *, size_t, size_t, void *);
+static char	*curl_libevent_url_key(CURL *, const char *);
+
+/* coalescing */
+struct curl_libevent_flight;
+static struct curl_libevent_flight
+		*curl_libevent_flight_find(struct curl_libevent *,
+		    const char *);
+static void	 curl_libevent_flight_create(struct curl_libevent *,
+		    struct curl_libevent_curl *, char *);
+static void	 curl_libevent_flight_leave(struct curl_libevent *,
+		    struct curl_libevent_curl *);
+static void	 curl_libevent_flight_done(struct curl_libevent *,
+		    struct curl_libevent_curl *, CURLMsg *);
+static void	 curl_libevent_flight_unref(struct curl_libevent_flight *);
+
+/* cache */
+struct curl_libevent_cache_entry;
+static struct curl_libevent_cache_entry
+		*curl_libevent_cache_find(struct curl_libevent *,
+		    const char *);
+static void	 curl_libevent_cache_hit(struct curl_libevent *,
+		    struct curl_libevent_curl *,
+		    struct curl_libevent_cache_entry *);
+static void	 curl_libevent_on_hits(int, short, void *);
+static void	 curl_libevent_cache_request(struct curl_libevent *,
+		    struct curl_libevent_curl *, char *,
+		    struct curl_libevent_cache_entry *);
+static void	 curl_libevent_cache_done(struct curl_libevent *,
+		    struct curl_libevent_curl *, CURLMsg *);
+static void	 curl_libevent_cache_store(struct curl_libevent *,
+		    struct curl_libevent_curl *, char *);
+static int	 curl_libevent_cache_freshness(CURL *, long *, bool *);
+static void	 curl_libevent_cache_remove(struct curl_libevent *,
+		    struct curl_libevent_cache_entry *);
+static void	 curl_libevent_cache_trim(struct curl_libevent *);
+static struct curl_slist
+		*curl_libevent_slist_printf(struct curl_slist *, const char *,
+		    const char *);
+
+/* hosts */
+struct curl_libevent_host;
+static struct curl_libevent_host
+		*curl_libevent_host_get(struct curl_libevent *, const char *);
+static void	 curl_libevent_host_ref(struct curl_libevent *,
+		    struct curl_libevent_host *);
+static void	 curl_libevent_host_unref(struct curl_libevent *,
+		    struct curl_libevent_host *);
+static void	 curl_libevent_host_account(struct curl_libevent_host *,
+		    CURL *);
+static uint64_t	 curl_libevent_host_percentile(struct curl_libevent_host *,
+		    unsigned);
+
+/* adaptive concurrency limit */
+struct curl_libevent_limiter;
+static void	 curl_libevent_limiter_init(struct curl_libevent_limiter *, int,
+		    unsigned, unsigned);
+static void	 curl_libevent_limiter_sample(struct curl_libevent_limiter *,
+		    double, unsigned, bool);
+static void	 curl_libevent_limit_account(struct curl_libevent *,
+		    struct curl_libevent_curl *, CURLMsg *);
+static void	 curl_libevent_host_release(struct curl_libevent *,
+		    struct curl_libevent_curl *);
+static bool	 curl_libevent_track_hosts(struct curl_libevent *);
+static unsigned	 curl_libevent_isqrt(unsigned);
+
+/* circuit breaker */
+static bool	 curl_libevent_breaker_allow(struct curl_libevent *,
+		    struct curl_libevent_curl *);
+static void	 curl_libevent_breaker_trip(struct curl_libevent *,
+		    struct curl_libevent_curl *);
+static void	 curl_libevent_breaker_account(struct curl_libevent *,
+		    struct curl_libevent_curl *, CURLMsg *);
+static void	 curl_libevent_breaker_open(struct curl_libevent *,
+		    struct curl_libevent_host *);
+
+/* hedging and mirrors */
+struct curl_libevent_hedge;
+static void	 curl_libevent_hedge_arm(struct curl_libevent *,
+		    struct curl_libevent_curl *);
+static void	 curl_libevent_hedge_on_timer(int, short, void *);
+static struct curl_libevent_curl
+		*curl_libevent_hedge_spawn(struct curl_libevent_hedge *,
+		    const char *);
+static void	 curl_libevent_hedge_next(struct curl_libevent *,
+		    struct curl_libevent_hedge *);
+static void	 curl_libevent_hedge_done(struct curl_libevent *,
+		    struct curl_libevent_curl *, CURLMsg *);
+static void	 curl_libevent_hedge_drop(struct curl_libevent *,
+		    struct curl_libevent_curl *);
+static void	 curl_libevent_hedge_free(struct curl_libevent *,
+		    struct curl_libevent_curl *);
+
+/* retries */
+static bool	 curl_libevent_retry_schedule(struct curl_libevent *,
+		    struct curl_libevent_curl *, CURLMsg *);
+static void	 curl_libevent_retry_on_timer(int, short, void *);
+static uint64_t	 curl_libevent_random(struct curl_libevent *);
+
+/* share */
+static void	 curl_libevent_share_account(struct curl_libevent_share *,
+		    CURL *);
+static void	 curl_libevent_share_lock(CURL *, curl_lock_data,
+		    curl_lock_access, void *);
+static void	 curl_libevent_share_unlock(CURL *, curl_lock_data, void *);
+
+/* sharded engine */
+struct curl_libevent_shard;
+static CURL_LIBEVENT_THREAD_FUNC
+		 curl_libevent_shard_main(void *);
+static void	 curl_libevent_shard_on_stop(evutil_socket_t, short, void *);
+static void	 curl_libevent_shard_on_complete(struct curl_libevent *,
+		    void *);
+static void	 curl_libevent_shard_fini(struct curl_libevent_shard *);
+
+/* miscellaneous */
+static int	 curl_libevent_host(CURL *, char *, size_t);
+static unsigned	 curl_libevent_strhash(const char *);
+static char	*curl_libevent_strdup(const char *);
+
+#define MINIMUM(_a, _b)		(((_a) < (_b))? (_a) : (_b))
+#define MAXIMUM(_a, _b)		(((_a) > (_b))? (_a) : (_b))
+
 #ifdef CURL_LIBEVENT_DEBUG
 #define CURL_LIBEVENT_DBG(arg)	warnx arg
 #else
@@ -69,11 +373,144 @@ static void	 vwarnx(const char *, va_list);
 struct curl_libevent_sock;
 struct curl_libevent_curl;
 
+static void	 curl_libevent_hash_insert(struct curl_libevent *,
+		    struct curl_libevent_curl *);
+static void	 curl_libevent_hash_remove(struct curl_libevent *,
+		    struct curl_libevent_curl *);
+static struct curl_libevent_curl
+		*curl_libevent_hash_find(struct curl_libevent *, CURL *);
+static void	 curl_libevent_hash_resize(struct curl_libevent *, int);
+static unsigned	 curl_libevent_hash_index(int, CURL *);
+static unsigned	 curl_libevent_tag_index(uintptr_t);
+static void	 curl_libevent_admit(struct curl_libevent *,
+		    struct curl_libevent_curl *);
+static void	 curl_libevent_start(struct curl_libevent *,
+		    struct curl_libevent_curl *);
+static void	 curl_libevent_deactivate(struct curl_libevent *,
+		    struct curl_libevent_curl *);
+static void	 curl_libevent_finish(struct curl_libevent *,
+		    struct curl_libevent_curl *, CURLMsg *);
+static void	 curl_libevent_unhook(struct curl_libevent_curl *);
+static void	 curl_libevent_unlink(struct curl_libevent *,
+		    struct curl_libevent_curl *);
+static void	 curl_libevent_abort(struct curl_libevent *,
+		    struct curl_libevent_curl *, CURLcode);
+static struct curl_libevent_curl
+		*curl_libevent_curl_alloc(struct curl_libevent *);
+static void	 curl_libevent_curl_free(struct curl_libevent *,
+		    struct curl_libevent_curl *);
+static void	 curl_libevent_curl_discard(struct curl_libevent_curl *);
+static struct curl_libevent_sock
+		*curl_libevent_sock_alloc(struct curl_libevent *);
+static void	 curl_libevent_sock_free(struct curl_libevent *,
+		    struct curl_libevent_sock *);
+
+#define CURL_LIBEVENT_TENANT_HASHSIZ	64
+#define CURL_LIBEVENT_BUCKET_HASHSIZ	64
+#define CURL_LIBEVENT_FLIGHT_HASHSIZ	64
+#define CURL_LIBEVENT_CACHE_HASHSIZ	256
+#define CURL_LIBEVENT_HOST_HASHSIZ	64
+#define CURL_LIBEVENT_HOST_IDLE_MAX	256	/* the unused ones kept */
+#define CURL_LIBEVENT_LAT_BUCKETS	168	/* up to 2^42 usec */
+#define CURL_LIBEVENT_TAG_HASHBITS	6
+#define CURL_LIBEVENT_WHEEL_BITS	6
+#define CURL_LIBEVENT_WHEEL_SLOTS	(1 << CURL_LIBEVENT_WHEEL_BITS)
+#define CURL_LIBEVENT_WHEEL_LEVELS	6	/* 64^6 ms covers 2^36 ms */
+
+struct curl_libevent_limiter {
+	int			 algo;		/* CURL_LIBEVENT_LIMIT_* */
+	unsigned		 min;
+	unsigned		 max;
+	double			 limit;
+	double			 rtt_short;	/* in usec */
+	double			 rtt_min;	/* without the load */
+	unsigned		 since_decrease;	/* in samples */
+};
+
+struct curl_libevent_batch {
+	struct curl_libevent_completion
+				*recs;
+	struct curl_libevent_body
+				**bodies;	/* referred by the records */
+	unsigned		 n;
+	unsigned		 siz;
+};
+
+struct curl_libevent_job {
+	struct curl_libevent_job
+				*next;		/* atomic */
+	struct curl_libevent	*parent;
+	void			(*on_done)(void *, CURLMsg *);
+	void			*ctx;
+	CURL			*handle;
+	CURLMsg			 msg;
+	struct curl_libevent_body
+				*body;
+	CURL			*put;	/* returned by on_done */
+};
+
+struct curl_libevent_jobq {
+	struct curl_libevent_job
+				*head;		/* atomic, producers */
+	struct curl_libevent_job
+				*tail;		/* consumer */
+	struct curl_libevent_job
+				 stub;
+};
+
+struct curl_libevent_executor {
+	struct curl_libevent	*parent;
+	int			 nworkers;
+	curl_libevent_thread_t	*workers;
+	/* to the workers, popped under the mutex */
+	struct curl_libevent_jobq
+				 runq;
+	curl_libevent_mutex_t	 runq_mtx;
+	evutil_socket_t		 runpairs[2];	/* a byte for a job */
+	/* back to the loop */
+	struct curl_libevent_jobq
+				 doneq;
+	unsigned		 done_wakeup;	/* atomic */
+	evutil_socket_t		 donepairs[2];
+	struct event		 ev_done;
+};
+
 struct curl_libevent {
 	CURLM			*handle;
 	struct event		 ev_timer;
+	struct timeval		 timer_at;	/* deadline of ev_timer */
 	struct event_base	*eb;
 	bool			 autoproxy;
+	bool			 deferred;	/* drain once per iteration */
+	bool			 dirty;
+	struct event		 ev_drain;
+	/* submissions from other threads, see curl_libevent_submit() */
+	struct curl_libevent_submission
+				*subq_head;	/* atomic, producers */
+	struct curl_libevent_submission
+				*subq_tail;	/* consumer */
+	struct curl_libevent_submission
+				*subq_stub;
+	unsigned		 subq_wakeup;	/* atomic */
+	evutil_socket_t		 subpairs[2];
+	struct event		 ev_submit;
+	/* batched completions, delivered after a pass of the events */
+	void			(*batch_done)(void *,
+				    const struct curl_libevent_completion *,
+				    unsigned);
+	void			*batch_arg;
+	struct curl_libevent_batch
+				 batches[2];	/* filling and delivering */
+	int			 batch_cur;
+	bool			 in_events;
+	struct event		 ev_batch;
+	/* on_done callbacks on the worker threads if any */
+	struct curl_libevent_executor
+				*executor;
+	/* called after each routed completion, for the sharded engine */
+	void			(*on_complete)(struct curl_libevent *, void *);
+	void			*on_complete_arg;
+	bool			 routing;	/* performing a routed one */
 #ifdef _WIN32
 	HANDLE			 hHttpSession;
 	SOCKET			 pairs[2];
@@ -83,11 +520,122 @@ struct curl_libevent {
 				 curls;
 	TAILQ_HEAD(, curl_libevent_sock)
 				 socks;
+	/* waiting for an active slot, per tenant */
+	LIST_HEAD(, curl_libevent_tenant)
+				 tenants[CURL_LIBEVENT_TENANT_HASHSIZ];
+	TAILQ_HEAD(, curl_libevent_tenant)
+				 backlog;	/* tenants having pending */
+	unsigned		 npending;
+	unsigned		 max_pending;
+	unsigned		 nactive;
+	unsigned		 max_active;
+	/* rate limiter */
+	LIST_HEAD(, curl_libevent_bucket)
+				 buckets[CURL_LIBEVENT_BUCKET_HASHSIZ];
+	unsigned		 nbuckets;
+	TAILQ_HEAD(, curl_libevent_bucket)
+				 bucket_lru;	/* of the default limit */
+	double			 bucket_rate;	/* default */
+	unsigned		 bucket_burst;
+	LIST_HEAD(, curl_libevent_curl)
+				 tags[1 << CURL_LIBEVENT_TAG_HASHBITS];
+	/* deadlines */
+	LIST_HEAD(, curl_libevent_curl)
+				 wheel[CURL_LIBEVENT_WHEEL_LEVELS]
+				    [CURL_LIBEVENT_WHEEL_SLOTS];
+	uint64_t		 wheel_bitmap[CURL_LIBEVENT_WHEEL_LEVELS];
+	uint64_t		 wheel_now;	/* the next tick to expire */
+	uint64_t		 wheel_next;	/* ev_wheel is armed for */
+	unsigned		 ndeadlines;
+	struct evutil_monotonic_timer
+				*clock;		/* not to follow the wall clock */
+	struct timeval		 wheel_epoch;
+	struct event		 ev_wheel;
+	/* coalescing, the transfers in flight by the key */
+	LIST_HEAD(, curl_libevent_flight)
+				 flights[CURL_LIBEVENT_FLIGHT_HASHSIZ];
+	struct curl_libevent_curl
+				*completing;	/* in on_done */
+	/* cache */
+	LIST_HEAD(, curl_libevent_cache_entry)
+				 cache[CURL_LIBEVENT_CACHE_HASHSIZ];
+	TAILQ_HEAD(curl_libevent_cache_lru, curl_libevent_cache_entry)
+				 cache_lru;	/* most recent first */
+	size_t			 cache_max;	/* bytes, 0 if disabled */
+	size_t			 cache_bytes;
+	unsigned		 ncache;
+	struct curl_libevent_cache_stats
+				 cache_stats;
+	TAILQ_HEAD(, curl_libevent_curl)
+				 hits;		/* to complete, or to fail fast */
+	unsigned		 nhits;
+	struct event		 ev_hits;
+	/* latencies, limits and breakers by the host */
+	LIST_HEAD(, curl_libevent_host)
+				 hosts[CURL_LIBEVENT_HOST_HASHSIZ];
+	TAILQ_HEAD(, curl_libevent_host)
+				 hostq;		/* having a room */
+	TAILQ_HEAD(, curl_libevent_host)
+				 hosts_idle;	/* by the last use */
+	unsigned		 nhosts_idle;
+	struct curl_libevent_limiter
+				 host_limiter;	/* to start a host with */
+	struct curl_libevent_limiter
+				 limiter;	/* drives max_active */
+	struct curl_libevent_breaker
+				 breaker;
+	/* hedging and mirrors */
+	double			 hedge_ratio;
+	double			 hedge_tokens;
+	TAILQ_HEAD(, curl_libevent_curl)
+				 racing;	/* failed, the others running */
+	/* retries */
+	double			 retry_ratio;
+	double			 retry_tokens;
+	TAILQ_HEAD(, curl_libevent_curl)
+				 retrying;	/* backing off */
+	uint64_t		 rand_state;
+	/* bandwidth shaping */
+	curl_off_t		 recv_limit;	/* bytes per second */
+	curl_off_t		 send_limit;
+	TAILQ_HEAD(, curl_libevent_curl)
+				 shaped;
+	unsigned		 shaped_weight;
+	struct event		 ev_shaper;
+	struct timeval		 bw_window;
+	uint64_t		 bw_recv;	/* in the window */
+	uint64_t		 bw_send;
+	struct curl_libevent_bandwidth_stats
+				 bw;
+	/* index of curls and pending by the easy handle */
+	LIST_HEAD(curl_libevent_hash, curl_libevent_curl)
+				*hash;
+	int			 hashbits;
+	unsigned		 ncurls;
+	/* free lists of the records */
+	TAILQ_HEAD(, curl_libevent_curl)
+				 curl_pool;
+	TAILQ_HEAD(, curl_libevent_sock)
+				 sock_pool;
+	unsigned		 ncurl_pool;
+	unsigned		 nsock_pool;
+	unsigned		 curl_pool_max;
+	unsigned		 sock_pool_max;
+	bool			 pool_zero;
+	/* recycled easy handles */
+	CURL			**easy_pool;
+	unsigned		 neasy_pool;
+	unsigned		 easy_pool_max;
+	struct curl_libevent_stats
+				 stats;
+	struct curl_libevent_share
+				*share;
 };
 
 struct curl_libevent_sock {
 	struct curl_libevent	*parent;
 	int			 sock;
+	short			 evmask;	/* currently requested */
 	struct event		 ev_sock;
 	TAILQ_ENTRY(curl_libevent_sock)
 				 next;
@@ -97,13 +645,229 @@ struct curl_libevent_curl {
 	struct curl_libevent	 *parent;
 	CURL			 *handle;
 	void			(*on_done)(void *, CURLMsg *);
+	int			  state;	/* CURL_LIBEVENT_CURL_* */
+	int			  priority;
+	struct curl_libevent_tenant
+				 *tenant;
+	struct timeval		  queued_at;
+	struct curl_libevent_bucket
+				 *bucket;	/* waiting for a token */
+	/* shaped if the callbacks are given */
+	curl_write_callback	  write_function;
+	void			 *write_data;
+	curl_read_callback	  read_function;
+	void			 *read_data;
+	unsigned		  bw_weight;
+	double			  recv_credit;
+	double			  send_credit;
+	int			  paused;	/* CURLPAUSE_* */
+	TAILQ_ENTRY(curl_libevent_curl)
+				  shaped;
+	uintptr_t		  tag;		/* 0 if none */
+	LIST_ENTRY(curl_libevent_curl)
+				  tagged;
+	uint64_t		  expires;	/* in ticks, 0 if none */
+	short			  wheel_level;
+	short			  wheel_slot;
+	LIST_ENTRY(curl_libevent_curl)
+				  wheel;
+	struct curl_libevent_flight
+				 *flight;	/* coalesced */
+	/* the body is kept if coalesced or cached */
+	struct curl_libevent_body
+				 *body;
+	bool			  buffering;	/* being written to body */
+	bool			  write_hooked;	/* by the library */
+	bool			  routed;	/* by the sharded engine */
+	char			 *cache_key;
+	struct curl_slist	 *headers;	/* given by the attribute */
+	struct curl_slist	 *cond_headers;	/* with the validators */
+	struct curl_libevent_body
+				 *cached;	/* being revalidated */
+	struct curl_libevent_host
+				 *host;		/* to account the latency */
+	bool			  probe;	/* of the half-open breaker */
+	bool			  host_slot;	/* counted in the host */
+	struct curl_libevent_hedge
+				 *hedge;
+	LIST_ENTRY(curl_libevent_curl)
+				  hedged;	/* in the duplicates */
+	struct curl_libevent_retry
+				  retry;	/* the policy */
+	unsigned		  attempts;	/* retried so far */
+	struct event		 *ev_retry;	/* while backing off */
 #ifdef _WIN32
 	HANDLE			  hProxyResolv;
+	CURLcode		  aborted;	/* while resolving the proxy */
 #endif
 	TAILQ_ENTRY(curl_libevent_curl)
 				  next;
+	LIST_ENTRY(curl_libevent_curl)
+				  hash;
+};
+
+struct curl_libevent_submission {
+	struct curl_libevent_submission
+				*next;		/* atomic */
+	CURL			*handle;
+	void			(*on_done)(void *, CURLMsg *);
+	bool			 routed;	/* by the sharded engine */
+};
+
+struct curl_libevent_tenant {
+	unsigned		 id;
+	unsigned		 weight;
+	unsigned		 max_active;
+	unsigned		 max_pending;
+	unsigned		 nactive;
+	unsigned		 npending;
+	int			 deficit;
+	unsigned		 refs;		/* by the records */
+	bool			 configured;	/* by set_tenant() */
+	TAILQ_HEAD(, curl_libevent_curl)
+				 pending[CURL_LIBEVENT_NPRIO];
+	struct curl_libevent_tenant_stats
+				 stats;
+	LIST_ENTRY(curl_libevent_tenant)
+				 hash;
+	TAILQ_ENTRY(curl_libevent_tenant)
+				 backlog;
+};
+
+struct curl_libevent_bucket {
+	struct curl_libevent	*parent;
+	char			*key;
+	double			 rate;		/* tokens per second */
+	double			 burst;
+	double			 tokens;
+	struct timeval		 refilled;
+	bool			 configured;	/* by set_rate_limit() */
+	TAILQ_HEAD(, curl_libevent_curl)
+				 waiting;
+	struct event		 ev_timer;
+	LIST_ENTRY(curl_libevent_bucket)
+				 hash;
+	TAILQ_ENTRY(curl_libevent_bucket)
+				 lru;
+};
+
+struct curl_libevent_body {
+	unsigned		 refs;
+	char			*buf;
+	size_t			 bufsiz;
+	struct curl_libevent_response
+				 resp;
+};
+
+struct curl_libevent_flight {
+	char			*key;
+	unsigned		 refs;
+	struct curl_libevent_curl
+				*leader;
+	TAILQ_HEAD(, curl_libevent_curl)
+				 waiters;
+	LIST_ENTRY(curl_libevent_flight)
+				 hash;
+};
+
+struct curl_libevent_cache_entry {
+	char			*key;
+	struct curl_libevent_body
+				*body;
+	size_t			 size;
+	char			*etag;
+	char			*last_modified;
+	long			 maxage;	/* seconds */
+	uint64_t		 expires;	/* in ticks */
+	LIST_ENTRY(curl_libevent_cache_entry)
+				 hash;
+	TAILQ_ENTRY(curl_libevent_cache_entry)
+				 lru;
+};
+
+struct curl_libevent_host {
+	char			*name;
+	unsigned		 nsamples;
+	unsigned		 latency[CURL_LIBEVENT_LAT_BUCKETS];
+	/* adaptive concurrency limit */
+	struct curl_libevent_limiter
+				 limiter;
+	unsigned		 nactive;	/* admitted */
+	TAILQ_HEAD(, curl_libevent_curl)
+				 throttled;
+	TAILQ_ENTRY(curl_libevent_host)
+				 hostq;
+	bool			 queued;	/* in hostq */
+	unsigned		 refs;		/* by the records */
+	TAILQ_ENTRY(curl_libevent_host)
+				 idle;
+	bool			 is_idle;	/* in hosts_idle */
+	/* circuit breaker */
+	int			 breaker;	/* CURL_LIBEVENT_BREAKER_* */
+	unsigned		 calls;		/* in the window */
+	unsigned		 failures;
+	unsigned		 slow;
+	uint64_t		 opened_at;	/* in ticks */
+	unsigned		 probes;	/* let through half-open */
+	unsigned		 probes_ok;
+	uint64_t		 opened;
+	uint64_t		 rejected;
+	LIST_ENTRY(curl_libevent_host)
+				 hash;
+};
+
+struct curl_libevent_hedge {
+	struct curl_libevent_curl
+				*primary;
+	LIST_HEAD(, curl_libevent_curl)
+				 dups;		/* started by duphandle */
+	unsigned		 ndups;
+	unsigned		 delay_ms;
+	char			**urls;		/* the mirrors, NULL if hedged */
+	unsigned		 nurls;
+	unsigned		 next;		/* the mirror to try next */
+	CURLcode		 result;	/* the last failure */
+	struct event		 ev_timer;
+};
+
+struct curl_libevent_share {
+	CURLSH			*handle;
+	curl_libevent_mutex_t	 locks[CURL_LOCK_DATA_LAST];
+	curl_libevent_mutex_t	 stats_mtx;
+	struct curl_libevent_share_stats
+				 stats;		/* protected by stats_mtx */
 };
 
+#define CURL_LIBEVENT_CURL_INIT		0
+#define CURL_LIBEVENT_CURL_WAITING	1	/* for a token */
+#define CURL_LIBEVENT_CURL_PENDING	2
+#define CURL_LIBEVENT_CURL_ACTIVE	3
+#define CURL_LIBEVENT_CURL_COALESCED	4	/* waiting for the leader */
+#define CURL_LIBEVENT_CURL_CACHED	5	/* to complete by the cache */
+#define CURL_LIBEVENT_CURL_RACING	6	/* failed, waiting the others */
+#define CURL_LIBEVENT_CURL_RETRYING	7	/* backing off */
+#define CURL_LIBEVENT_CURL_TRIPPED	8	/* to fail by the breaker */
+#define CURL_LIBEVENT_CURL_THROTTLED	9	/* by the limit of the host */
+
+#define CURL_LIBEVENT_HASH_MINBITS	6
+#define CURL_LIBEVENT_SUBMIT_BATCH	256
+#define CURL_LIBEVENT_SHAPER_TICK	20	/* ms */
+#define CURL_LIBEVENT_POOL_DEFAULT	64
+#define CURL_LIBEVENT_LAT_MINSAMPLES	20
+#define CURL_LIBEVENT_LAT_DECAY		2048
+#define CURL_LIBEVENT_HEDGE_RATIO	0.05
+#define CURL_LIBEVENT_HEDGE_BURST	10
+#define CURL_LIBEVENT_RETRY_RATIO	0.1
+#define CURL_LIBEVENT_RETRY_BURST	10
+#define CURL_LIBEVENT_LIMIT_INITIAL	20
+#define CURL_LIBEVENT_LIMIT_MAX		1000
+#define CURL_LIBEVENT_LIMIT_SHORTWIN	10	/* samples */
+#define CURL_LIBEVENT_LIMIT_MINWIN	50000	/* for the minimum to creep */
+#define CURL_LIBEVENT_LIMIT_TOLERANCE	1.5	/* of the gradient */
+#define CURL_LIBEVENT_LIMIT_SMOOTHING	0.05
+#define CURL_LIBEVENT_LIMIT_AIMD_RATIO	2.0	/* to the min latency */
+#define CURL_LIBEVENT_LIMIT_BACKOFF	0.9
+
 #ifdef _WIN32
 struct pair_event {
 	DWORD_PTR	context;
@@ -115,12 +879,60 @@ struct curl_libevent *
 curl_libevent_create(struct event_base *eb)
 {
 	struct curl_libevent	*self;
+	struct timeval		 tv;
+	int			 i, j;
 
 	self = xcalloc(1, sizeof(*self));
 	self->handle = curl_multi_init();
 	self->eb = eb;
 	TAILQ_INIT(&self->curls);
 	TAILQ_INIT(&self->socks);
+	for (i = 0; i < CURL_LIBEVENT_TENANT_HASHSIZ; i++)
+		LIST_INIT(&self->tenants[i]);
+	TAILQ_INIT(&self->backlog);
+	for (i = 0; i < CURL_LIBEVENT_BUCKET_HASHSIZ; i++)
+		LIST_INIT(&self->buckets[i]);
+	TAILQ_INIT(&self->bucket_lru);
+	for (i = 0; i < CURL_LIBEVENT_FLIGHT_HASHSIZ; i++)
+		LIST_INIT(&self->flights[i]);
+	for (i = 0; i < CURL_LIBEVENT_CACHE_HASHSIZ; i++)
+		LIST_INIT(&self->cache[i]);
+	TAILQ_INIT(&self->cache_lru);
+	TAILQ_INIT(&self->hits);
+	TAILQ_INIT(&self->racing);
+	for (i = 0; i < CURL_LIBEVENT_HOST_HASHSIZ; i++)
+		LIST_INIT(&self->hosts[i]);
+	TAILQ_INIT(&self->hostq);
+	TAILQ_INIT(&self->hosts_idle);
+	self->hedge_ratio = CURL_LIBEVENT_HEDGE_RATIO;
+	self->retry_ratio = CURL_LIBEVENT_RETRY_RATIO;
+	self->retry_tokens = CURL_LIBEVENT_RETRY_BURST;	/* a reserve */
+	TAILQ_INIT(&self->retrying);
+	TAILQ_INIT(&self->shaped);
+	for (i = 0; i < (1 << CURL_LIBEVENT_TAG_HASHBITS); i++)
+		LIST_INIT(&self->tags[i]);
+	for (i = 0; i < CURL_LIBEVENT_WHEEL_LEVELS; i++) {
+		for (j = 0; j < CURL_LIBEVENT_WHEEL_SLOTS; j++)
+			LIST_INIT(&self->wheel[i][j]);
+	}
+	if ((self->clock = evutil_monotonic_timer_new()) == NULL ||
+	    evutil_configure_monotonic_time(self->clock, EV_MONOT_PRECISE)
+	    == -1)
+		abort();
+	curl_libevent_now(self, &self->wheel_epoch);
+	evutil_gettimeofday(&tv, NULL);
+	self->rand_state = (uintptr_t)self ^ ((uint64_t)tv.tv_sec << 20) ^
+	    tv.tv_usec;
+	curl_libevent_tenant_get(self, 0)->configured = true;
+	self->hashbits = CURL_LIBEVENT_HASH_MINBITS;
+	self->hash = xcalloc(1U << self->hashbits, sizeof(self->hash[0]));
+	TAILQ_INIT(&self->curl_pool);
+	TAILQ_INIT(&self->sock_pool);
+	self->curl_pool_max = CURL_LIBEVENT_POOL_DEFAULT;
+	self->sock_pool_max = CURL_LIBEVENT_POOL_DEFAULT;
+	self->pool_zero = true;
+	self->subq_stub = xcalloc(1, sizeof(*self->subq_stub));
+	self->subq_head = self->subq_tail = self->subq_stub;
 
 	curl_multi_setopt(self->handle, CURLMOPT_SOCKETFUNCTION,
 	    curl_libevent_set_events);
@@ -131,6 +943,39 @@ curl_libevent_create(struct event_base *eb)
 	evtimer_set(&self->ev_timer, curl_libevent_on_timer, self);
 	if (self->eb != NULL)
 		event_base_set(self->eb, &self->ev_timer);
+	event_set(&self->ev_shaper, -1, EV_PERSIST, curl_libevent_on_shaper,
+	    self);
+	if (self->eb != NULL)
+		event_base_set(self->eb, &self->ev_shaper);
+	evtimer_set(&self->ev_wheel, curl_libevent_on_wheel, self);
+	if (self->eb != NULL)
+		event_base_set(self->eb, &self->ev_wheel);
+	event_set(&self->ev_hits, -1, 0, curl_libevent_on_hits, self);
+	if (self->eb != NULL)
+		event_base_set(self->eb, &self->ev_hits);
+	event_set(&self->ev_batch, -1, 0, curl_libevent_on_batch, self);
+	if (self->eb != NULL)
+		event_base_set(self->eb, &self->ev_batch);
+	event_set(&self->ev_drain, -1, 0, curl_libevent_on_drain, self);
+	if (self->eb != NULL) {
+		event_base_set(self->eb, &self->ev_drain);
+		/* run after the I/O events of the iteration */
+		if (event_base_get_npriorities(self->eb) > 1)
+			event_priority_set(&self->ev_drain,
+			    event_base_get_npriorities(self->eb) - 1);
+	}
+	if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, self->subpairs) != -1) {
+		evutil_make_socket_nonblocking(self->subpairs[0]);
+		evutil_make_socket_nonblocking(self->subpairs[1]);
+		event_set(&self->ev_submit, self->subpairs[0],
+		    EV_READ | EV_PERSIST, curl_libevent_on_submit, self);
+		if (self->eb != NULL)
+			event_base_set(self->eb, &self->ev_submit);
+		event_add(&self->ev_submit, NULL);
+	} else {
+		warnx("%s: socketpair() failed", __func__);
+		self->subpairs[0] = self->subpairs[1] = -1;
+	}
 
 #ifdef _WIN32
 	if ((self->hHttpSession = WinHttpOpen(L"curl_libevent",
@@ -168,20 +1013,464 @@ curl_libevent_set_auto_proxy_config(struct curl_libevent *self, bool onoff)
 	self->autoproxy = onoff;
 }
 
+/*
+ * Keep up to ncurls transfer records and nsocks socket records for reuse
+ * and allocate them now, so that an instance which stays within these
+ * numbers does no heap allocation in the steady state.
+ */
+void
+curl_libevent_set_pool_size(struct curl_libevent *self, unsigned ncurls,
+    unsigned nsocks)
+{
+	struct curl_libevent_curl	*curl;
+	struct curl_libevent_sock	*sock;
+	int				 nbits;
+
+	self->curl_pool_max = ncurls;
+	self->sock_pool_max = nsocks;
+	while (self->ncurl_pool > ncurls) {
+		curl = TAILQ_FIRST(&self->curl_pool);
+		TAILQ_REMOVE(&self->curl_pool, curl, next);
+		self->ncurl_pool--;
+		xfree(curl);
+	}
+	while (self->nsock_pool > nsocks) {
+		sock = TAILQ_FIRST(&self->sock_pool);
+		TAILQ_REMOVE(&self->sock_pool, sock, next);
+		self->nsock_pool--;
+		xfree(sock);
+	}
+	while (self->ncurl_pool + self->ncurls < ncurls) {
+		curl = xcalloc(1, sizeof(*curl));
+		TAILQ_INSERT_TAIL(&self->curl_pool, curl, next);
+		self->ncurl_pool++;
+	}
+	while (self->nsock_pool < nsocks) {
+		sock = xcalloc(1, sizeof(*sock));
+		TAILQ_INSERT_TAIL(&self->sock_pool, sock, next);
+		self->nsock_pool++;
+	}
+
+	/* size the index as well so that it never grows */
+	for (nbits = self->hashbits; (1U << nbits) < ncurls; nbits++)
+		;
+	if (nbits > self->hashbits)
+		curl_libevent_hash_resize(self, nbits);
+}
+
+/*
+ * Released records are zeroed by default like freezero(3).  Passing false
+ * skips it; the records are initialized when they are reused anyway.
+ */
+void
+curl_libevent_set_pool_zeroing(struct curl_libevent *self, bool onoff)
+{
+	self->pool_zero = onoff;
+}
+
+/*
+ * In the deferred mode, the completions are not read after every
+ * curl_multi_socket_action() but once from an event activated at the end
+ * of the loop iteration, so the on_done callbacks are called in a batch.
+ */
+void
+curl_libevent_set_deferred_completion(struct curl_libevent *self,
+    bool onoff)
+{
+	self->deferred = onoff;
+	if (!onoff && self->dirty) {
+		event_del(&self->ev_drain);
+		self->dirty = false;
+		curl_libevent_events(self);
+	}
+}
+
+/*
+ * Keep up to max easy handles which are returned by
+ * curl_libevent_easy_put() for reuse.  0 disables the pool.
+ */
+void
+curl_libevent_set_easy_pool(struct curl_libevent *self, unsigned max)
+{
+	CURL	**pool;
+
+	while (self->neasy_pool > max)
+		curl_easy_cleanup(self->easy_pool[--self->neasy_pool]);
+	if (max > 0) {
+		pool = xcalloc(max, sizeof(pool[0]));
+		if (self->neasy_pool > 0)
+			memcpy(pool, self->easy_pool,
+			    self->neasy_pool * sizeof(pool[0]));
+	} else
+		pool = NULL;
+	xfree(self->easy_pool);
+	self->easy_pool = pool;
+	self->easy_pool_max = max;
+}
+
+/* Get an easy handle, a recycled one if the pool has */
+CURL *
+curl_libevent_easy_get(struct curl_libevent *self)
+{
+	if (self->neasy_pool > 0) {
+		self->stats.easy_hits++;
+		return (self->easy_pool[--self->neasy_pool]);
+	}
+	self->stats.easy_misses++;
+
+	return (curl_easy_init());
+}
+
+/*
+ * Return an easy handle instead of curl_easy_cleanup().  curl_easy_reset()
+ * clears the options but keeps the live connections, the DNS cache and the
+ * TLS session ID cache of the handle.  The handles finished without an
+ * on_done callback are returned here as well.  It may be called in the
+ * on_done on a worker of the executor.
+ */
+void
+curl_libevent_easy_put(struct curl_libevent *self, CURL *handle)
+{
+	struct curl_libevent_job	*job = curl_libevent_job_current;
+
+	if (job != NULL && job->parent == self) {
+		/* on a worker, the loop takes it after on_done returns */
+		if (job->put == NULL)
+			job->put = handle;
+		else
+			curl_easy_cleanup(handle);
+		return;
+	}
+	if (self->neasy_pool >= self->easy_pool_max) {
+		curl_easy_cleanup(handle);
+		return;
+	}
+	curl_easy_reset(handle);
+	self->easy_pool[self->neasy_pool++] = handle;
+}
+
+void
+curl_libevent_get_stats(struct curl_libevent *self,
+    struct curl_libevent_stats *stats)
+{
+	*stats = self->stats;
+}
+
+/*
+ * Limit the number of the active transfers.  The requests over the limit
+ * wait in the pending queue in FIFO order within a priority class and
+ * are started as the active transfers complete.  0 means no limit.
+ */
+void
+curl_libevent_set_max_active(struct curl_libevent *self, unsigned max)
+{
+	self->max_active = max;
+	curl_libevent_promote(self);
+}
+
+/*
+ * Limit the length of the pending queue.  curl_libevent_perform() fails
+ * when the queue is full.  0 means no limit.
+ */
+void
+curl_libevent_set_max_pending(struct curl_libevent *self, unsigned max)
+{
+	self->max_pending = max;
+}
+
 void
+curl_libevent_attr_init(struct curl_libevent_attr *attr)
+{
+	memset(attr, 0, sizeof(*attr));
+	attr->priority = CURL_LIBEVENT_PRIO_NORMAL;
+	attr->tenant = 0;
+	attr->rate_key = NULL;
+	attr->bw_weight = 1;
+}
+
+int
 curl_libevent_perform(struct curl_libevent *self, CURL *handle,
     void (*on_done)(void *, CURLMsg *))
+{
+	return (curl_libevent_perform_attr(self, handle, on_done, NULL));
+}
+
+/*
+ * Perform with the attributes.  The transfers of a higher priority class
+ * are started first from the pending queue, and the class is mapped to
+ * the HTTP/2 stream weight.
+ */
+int
+curl_libevent_perform_attr(struct curl_libevent *self, CURL *handle,
+    void (*on_done)(void *, CURLMsg *), const struct curl_libevent_attr *attr)
+{
+	return (curl_libevent_perform_internal(self, handle, on_done, attr,
+	    NULL, 0, 0));
+}
+
+/*
+ * Perform the request on the mirrors, urls[0] first and the next one
+ * every stagger_ms or as soon as one fails, all at once if stagger_ms is
+ * 0.  The first success wins and the others are removed.  on_done is
+ * called with the last failure if all of them fail.  The body is kept by
+ * the library like a hedged request.
+ */
+int
+curl_libevent_perform_mirrors(struct curl_libevent *self, CURL *handle,
+    const char *const *urls, unsigned nurls, unsigned stagger_ms,
+    void (*on_done)(void *, CURLMsg *), const struct curl_libevent_attr *attr)
+{
+	if (nurls == 0)
+		return (-1);
+	curl_easy_setopt(handle, CURLOPT_URL, urls[0]);
+
+	return (curl_libevent_perform_internal(self, handle, on_done, attr,
+	    urls, nurls, stagger_ms));
+}
+
+int
+curl_libevent_perform_internal(struct curl_libevent *self, CURL *handle,
+    void (*on_done)(void *, CURLMsg *), const struct curl_libevent_attr *attr,
+    const char *const *urls, unsigned nurls, unsigned stagger_ms)
 {
 	struct curl_libevent_curl *curl;
+	struct curl_libevent_attr  defattr;
+	struct curl_libevent_tenant
+				  *tenant;
+	struct curl_libevent_flight
+				  *flight = NULL;
+	struct curl_libevent_cache_entry
+				  *entry = NULL;
+	struct curl_libevent_hedge
+				  *hedge;
+	char			  *key = NULL, *ckey = NULL;
+	char			   host[256];
+	bool			   full, hit = false;
+	unsigned		   i;
+	static const long	   weights[CURL_LIBEVENT_NPRIO] = {
+		1,	/* CURL_LIBEVENT_PRIO_BULK */
+		16,	/* CURL_LIBEVENT_PRIO_NORMAL, the default of HTTP/2 */
+		256	/* CURL_LIBEVENT_PRIO_INTERACTIVE */
+	};
+
+	if (attr == NULL) {
+		curl_libevent_attr_init(&defattr);
+		attr = &defattr;
+	}
+	if (attr->priority < 0 || attr->priority >= CURL_LIBEVENT_NPRIO)
+		return (-1);
+
+	/* neither a hit nor a waiter takes a slot */
+	if (self->cache_max > 0 && attr->cache_key != NULL &&
+	    (ckey = curl_libevent_url_key(handle, attr->cache_key)) != NULL) {
+		if ((entry = curl_libevent_cache_find(self, ckey)) != NULL &&
+		    entry->expires > curl_libevent_wheel_ticks(self))
+			hit = true;
+		else
+			self->cache_stats.misses++;
+	}
+	if (!hit && attr->coalesce_key != NULL &&
+	    (key = curl_libevent_url_key(handle, attr->coalesce_key)) !=
+	    NULL && (flight = curl_libevent_flight_find(self, key)) != NULL) {
+		xfree(key);
+		key = NULL;
+	}
 
+	tenant = curl_libevent_tenant_get(self, attr->tenant);
+	full = (self->max_active > 0 && self->nactive >= self->max_active) ||
+	    (tenant->max_active > 0 && tenant->nactive >= tenant->max_active);
+	if (!hit && flight == NULL && full && ((self->max_pending > 0 &&
+	    self->npending >= self->max_pending) || (tenant->max_pending > 0 &&
+	    tenant->npending >= tenant->max_pending))) {
+		self->stats.rejected++;
+		tenant->stats.rejected++;
+		curl_libevent_tenant_put(self, tenant);
+		xfree(key);
+		xfree(ckey);
+		return (-1);
+	}
 
-	curl = xcalloc(1, sizeof(*curl));
+	curl = curl_libevent_curl_alloc(self);
 	curl->parent = self;
 	curl->handle = handle;
 	curl->on_done = on_done;
+	curl->routed = self->routing;
+	curl->priority = attr->priority;
+	curl->tenant = tenant;
+	tenant->refs++;
+	curl->bw_weight = (attr->bw_weight > 0)? attr->bw_weight : 1;
+	if (attr->coalesce_key != NULL || ckey != NULL ||
+	    attr->hedge_ms > 0 || urls != NULL)
+		;	/* the body is kept by the library */
+	else if ((curl->write_function = attr->write_function) != NULL) {
+		curl->write_data = attr->write_data;
+		curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION,
+		    curl_libevent_shaper_write);
+		curl_easy_setopt(handle, CURLOPT_WRITEDATA, curl);
+		curl->write_hooked = true;
+	}
+	if ((curl->read_function = attr->read_function) != NULL) {
+		curl->read_data = attr->read_data;
+		curl_easy_setopt(handle, CURLOPT_READFUNCTION,
+		    curl_libevent_shaper_read);
+		curl_easy_setopt(handle, CURLOPT_READDATA, curl);
+	}
+	if ((curl->headers = attr->headers) != NULL)
+		curl_easy_setopt(handle, CURLOPT_HTTPHEADER, curl->headers);
+	if (attr->retry != NULL)
+		curl->retry = *attr->retry;
+	/* keep the weight the caller set unless a class is asked */
+	if (curl->priority != CURL_LIBEVENT_PRIO_NORMAL)
+		curl_easy_setopt(handle, CURLOPT_STREAM_WEIGHT,
+		    weights[curl->priority]);
+	if (self->share != NULL)
+		curl_easy_setopt(handle, CURLOPT_SHARE, self->share->handle);
+	curl_libevent_hash_insert(self, curl);
+	if ((curl->tag = attr->tag) != 0)
+		LIST_INSERT_HEAD(&self->tags[curl_libevent_tag_index(curl->tag)],
+		    curl, tagged);
+	if ((curl_libevent_track_hosts(self) ||
+	    attr->hedge_ms == CURL_LIBEVENT_HEDGE_AUTO) &&
+	    curl_libevent_host(handle, host, sizeof(host)) == 0)
+		curl->host = curl_libevent_host_get(self, host);
+	if (attr->deadline_ms > 0) {
+		/* + 1 not to expire early by the truncation */
+		curl->expires = curl_libevent_wheel_ticks(self) +
+		    attr->deadline_ms + 1;
+		curl_libevent_wheel_insert(self, curl);
+	}
+	if (hit) {
+		curl_libevent_cache_hit(self, curl, entry);
+		xfree(ckey);
+		return (0);
+	}
+	if (flight != NULL) {
+		xfree(ckey);
+		curl->state = CURL_LIBEVENT_CURL_COALESCED;
+		curl->flight = flight;
+		flight->refs++;
+		TAILQ_INSERT_TAIL(&flight->waiters, curl, next);
+		self->stats.coalesced++;
+		return (0);
+	}
+	/* the mirrors fail over by themselves */
+	if (urls == NULL && !curl_libevent_breaker_allow(self, curl)) {
+		curl_libevent_breaker_trip(self, curl);
+		xfree(key);
+		xfree(ckey);
+		return (0);
+	}
+	if (ckey != NULL)
+		curl_libevent_cache_request(self, curl, ckey, entry);
+	if (key != NULL)
+		curl_libevent_flight_create(self, curl, key);
+	if (attr->hedge_ms > 0 || urls != NULL) {
+		hedge = xcalloc(1, sizeof(*hedge));
+		hedge->primary = curl;
+		LIST_INIT(&hedge->dups);
+		evtimer_set(&hedge->ev_timer, curl_libevent_hedge_on_timer,
+		    hedge);
+		if (self->eb != NULL)
+			event_base_set(self->eb, &hedge->ev_timer);
+		curl->hedge = hedge;
+		curl_libevent_buffer(curl);
+		if (urls != NULL) {
+			hedge->delay_ms = stagger_ms;
+			hedge->urls = xcalloc(nurls, sizeof(char *));
+			for (i = 0; i < nurls; i++)
+				hedge->urls[i] = curl_libevent_strdup(urls[i]);
+			hedge->nurls = nurls;
+			hedge->next = 1;
+		} else
+			hedge->delay_ms = attr->hedge_ms;
+	}
+
+	if (self->nbuckets > 0 || self->bucket_rate > 0) {
+		if (curl_libevent_ratelimit(self, curl, attr->rate_key))
+			return (0);	/* waits for a token */
+	}
+	curl_libevent_admit(self, curl);
+
+	return (0);
+}
+
+/* Start the transfer or queue it if the limits don't allow */
+void
+curl_libevent_admit(struct curl_libevent *self,
+    struct curl_libevent_curl *curl)
+{
+	struct curl_libevent_tenant	*tenant = curl->tenant;
+	struct curl_libevent_host	*host = curl->host;
+
+	if (host != NULL && host->limiter.algo != CURL_LIBEVENT_LIMIT_NONE) {
+		if (host->nactive >= (unsigned)host->limiter.limit) {
+			curl->state = CURL_LIBEVENT_CURL_THROTTLED;
+			TAILQ_INSERT_TAIL(&host->throttled, curl, next);
+			return;
+		}
+		host->nactive++;
+		curl->host_slot = true;
+	}
+	if ((self->max_active > 0 && self->nactive >= self->max_active) ||
+	    (tenant->max_active > 0 && tenant->nactive >= tenant->max_active))
+		curl_libevent_tenant_enqueue(self, curl);
+	else
+		curl_libevent_start(self, curl);
+}
+
+/* Start the transfers in the pending queue as far as the limit allows */
+void
+curl_libevent_promote(struct curl_libevent *self)
+{
+	struct curl_libevent_curl	*curl;
+	struct curl_libevent_host	*host;
+
+	while ((host = TAILQ_FIRST(&self->hostq)) != NULL) {
+		TAILQ_REMOVE(&self->hostq, host, hostq);
+		host->queued = false;
+		curl_libevent_host_ref(self, host);	/* while admitting */
+		while ((curl = TAILQ_FIRST(&host->throttled)) != NULL &&
+		    (host->limiter.algo == CURL_LIBEVENT_LIMIT_NONE ||
+		    host->nactive < (unsigned)host->limiter.limit)) {
+			TAILQ_REMOVE(&host->throttled, curl, next);
+			curl->state = CURL_LIBEVENT_CURL_INIT;
+			curl_libevent_admit(self, curl);
+		}
+		curl_libevent_host_unref(self, host);
+	}
+	while (self->npending > 0 &&
+	    (self->max_active == 0 || self->nactive < self->max_active)) {
+		if ((curl = curl_libevent_tenant_dequeue(self)) == NULL)
+			break;	/* the tenants are capped */
+		curl_libevent_start(self, curl);
+	}
+}
+
+void
+curl_libevent_start(struct curl_libevent *self,
+    struct curl_libevent_curl *curl)
+{
+	curl->state = CURL_LIBEVENT_CURL_ACTIVE;
+	self->nactive++;
+	curl->tenant->nactive++;
+	curl->tenant->stats.started++;
+	TAILQ_INSERT_TAIL(&self->curls, curl, next);
+	if (curl->write_function != NULL || curl->read_function != NULL)
+		curl_libevent_shaper_add(self, curl);
+	if (curl->hedge == NULL || curl->hedge->primary == curl) {
+		self->hedge_tokens = MINIMUM(self->hedge_tokens +
+		    self->hedge_ratio, CURL_LIBEVENT_HEDGE_BURST);
+		if (curl->attempts == 0)
+			self->retry_tokens = MINIMUM(self->retry_tokens +
+			    self->retry_ratio, CURL_LIBEVENT_RETRY_BURST);
+		if (curl->hedge != NULL)
+			curl_libevent_hedge_arm(self, curl);
+	}
 
 #ifdef _WIN32
-	if (self->autoproxy) {
+	/* a duplicate takes the proxy of the request by duphandle */
+	if (self->autoproxy &&
+	    (curl->hedge == NULL || curl->hedge->primary == curl)) {
 		char				*url;
 #define URLMAXLEN	(128*1024)
 		wchar_t				*urlw;
@@ -196,8 +1485,8 @@ curl_libevent_perform(struct curl_libevent *self, CURL *handle,
 
 		if (self->hHttpSession == INVALID_HANDLE_VALUE)
 			goto skip;
-		if (curl_easy_getinfo(handle, CURLINFO_EFFECTIVE_URL, &url) !=
-		    CURLE_OK)
+		if (curl_easy_getinfo(curl->handle, CURLINFO_EFFECTIVE_URL,
+		    &url) != CURLE_OK)
 			goto skip;
 		if (!WinHttpGetIEProxyConfigForCurrentUser(&ieConfig))
 			goto skip;
@@ -227,75 +1516,462 @@ curl_libevent_perform(struct curl_libevent *self, CURL *handle,
 			goto skip;
 		}
 		xfree(urlw);
-		TAILQ_INSERT_TAIL(&self->curls, curl, next);
 		return;
 	}
  skip:
+	if (curl->hProxyResolv != INVALID_HANDLE_VALUE) {
+		/* failed after creating the resolver, abort() must not wait */
+		WinHttpCloseHandle(curl->hProxyResolv);
+		curl->hProxyResolv = INVALID_HANDLE_VALUE;
+	}
 #endif
-	curl_multi_add_handle(self->handle, handle);
-	TAILQ_INSERT_TAIL(&self->curls, curl, next);
+	curl_multi_add_handle(self->handle, curl->handle);
 }
 
+/* Take the active transfer out of the accounting, not from the multi */
 void
-curl_libevent_on_event(int fd, short evmask, void *ctx)
+curl_libevent_deactivate(struct curl_libevent *self,
+    struct curl_libevent_curl *curl)
 {
-	struct curl_libevent_sock
-			*self = ctx;
-	struct curl_libevent
-			*parent;
-	int		 flags = 0, running_handles = 0;
-
-	if (evmask & EV_READ)
-		flags |= CURL_CSELECT_IN;
-	if (evmask & EV_WRITE)
-		flags |= CURL_CSELECT_OUT;
-
-	parent = self->parent;
-	curl_multi_socket_action(self->parent->handle, self->sock, flags,
-	    &running_handles);
-	self = NULL;	/* self may be destroyed */
-	curl_libevent_events(parent);
+	TAILQ_REMOVE(&self->curls, curl, next);
+	self->nactive--;
+	curl->tenant->nactive--;
+	if (curl->write_function != NULL || curl->read_function != NULL)
+		curl_libevent_shaper_remove(self, curl);
+	curl_libevent_host_release(self, curl);
 }
 
+/* Release the record of a transfer done and call back */
 void
-curl_libevent_on_timer(int fd, short evmask, void *ctx)
+curl_libevent_finish(struct curl_libevent *self,
+    struct curl_libevent_curl *curl, CURLMsg *msg)
 {
-	struct curl_libevent	*self = ctx;
-	int			 running_handles;
-
-	curl_multi_socket_action(self->handle, CURL_SOCKET_TIMEOUT, 0,
-	    &running_handles);
+	struct curl_libevent_curl
+			*completing;
+	void		*ctx = NULL;
 
-	curl_libevent_events(self);
+	curl_libevent_unhook(curl);
+	if (curl->buffering) {
+		curl->buffering = false;
+		curl->body->resp.result = msg->data.result;
+		curl_easy_getinfo(curl->handle, CURLINFO_RESPONSE_CODE,
+		    &curl->body->resp.code);
+	}
+	if (curl->cache_key != NULL)
+		curl_libevent_cache_done(self, curl, msg);
+	if (curl->flight != NULL && curl->flight->leader == curl) {
+		/* completes the waiters after the leader */
+		curl_libevent_flight_done(self, curl, msg);
+		return;
+	}
+	if (curl->probe && curl->host->breaker ==
+	    CURL_LIBEVENT_BREAKER_HALF_OPEN)
+		curl->host->probes--;	/* aborted, let another go */
+	if (curl->state == CURL_LIBEVENT_CURL_ACTIVE)
+		curl_libevent_deactivate(self, curl);
+	else if (curl->state == CURL_LIBEVENT_CURL_RACING)
+		TAILQ_REMOVE(&self->racing, curl, next);
+	curl_libevent_hash_remove(self, curl);
+	if (curl->tag != 0)
+		LIST_REMOVE(curl, tagged);
+	if (curl->expires != 0)
+		curl_libevent_wheel_remove(self, curl);
+	curl_easy_getinfo(curl->handle, CURLINFO_PRIVATE, &ctx);
+	completing = self->completing;
+	self->completing = curl;
+	if (curl->on_done && self->executor != NULL)
+		curl_libevent_executor_push(self, ctx, curl->on_done, msg,
+		    curl->handle, curl->body);
+	else if (curl->on_done)
+		curl->on_done(ctx, msg);
+	else if (self->batch_done != NULL)
+		curl_libevent_batch_add(self, ctx, curl->handle,
+		    msg->data.result, curl->body);
+	else
+		curl_libevent_easy_put(self, curl->handle);
+	self->completing = completing;
+	if (curl->flight != NULL)
+		curl_libevent_flight_unref(curl->flight);
+	if (curl->body != NULL)
+		curl_libevent_body_unref(curl->body);
+	if (curl->routed && self->on_complete != NULL)
+		self->on_complete(self, self->on_complete_arg);
+	curl_libevent_curl_free(self, curl);
+	curl_libevent_promote(self);
 }
 
+/*
+ * Give the handle back without the callbacks of the library, whose data
+ * are freed after on_done: with the callbacks of the attribute if given,
+ * or the defaults of libcurl.
+ */
 void
-curl_libevent_events(struct curl_libevent *self)
+curl_libevent_unhook(struct curl_libevent_curl *curl)
+{
+	if (curl->write_hooked) {
+		curl->write_hooked = false;
+		curl_easy_setopt(curl->handle, CURLOPT_WRITEFUNCTION,
+		    curl->write_function);
+		curl_easy_setopt(curl->handle, CURLOPT_WRITEDATA,
+		    (curl->write_function != NULL)? curl->write_data :
+		    (void *)stdout);
+	}
+	if (curl->read_function != NULL) {
+		curl_easy_setopt(curl->handle, CURLOPT_READFUNCTION,
+		    curl->read_function);
+		curl_easy_setopt(curl->handle, CURLOPT_READDATA,
+		    curl->read_data);
+	}
+}
+
+/*
+ * Take the transfer out of wherever it is, waiting for a token, pending,
+ * active, racing or coalesced.  The record is left in the hash.
+ */
+void
+curl_libevent_unlink(struct curl_libevent *self,
+    struct curl_libevent_curl *curl)
+{
+	struct curl_libevent_tenant	*tenant = curl->tenant;
+
+	switch (curl->state) {
+	case CURL_LIBEVENT_CURL_WAITING:
+		TAILQ_REMOVE(&curl->bucket->waiting, curl, next);
+		curl->bucket = NULL;
+		break;
+	case CURL_LIBEVENT_CURL_PENDING:
+		TAILQ_REMOVE(&tenant->pending[curl->priority], curl, next);
+		if (--tenant->npending == 0)
+			TAILQ_REMOVE(&self->backlog, tenant, backlog);
+		self->npending--;
+		curl_libevent_host_release(self, curl);
+		break;
+	case CURL_LIBEVENT_CURL_THROTTLED:
+		TAILQ_REMOVE(&curl->host->throttled, curl, next);
+		break;
+	case CURL_LIBEVENT_CURL_COALESCED:
+		/* still in the flight, flight_leave() releases it */
+		TAILQ_REMOVE(&curl->flight->waiters, curl, next);
+		break;
+	case CURL_LIBEVENT_CURL_CACHED:
+	case CURL_LIBEVENT_CURL_TRIPPED:
+		TAILQ_REMOVE(&self->hits, curl, next);
+		self->nhits--;
+		break;
+	case CURL_LIBEVENT_CURL_ACTIVE:
+		curl_multi_remove_handle(self->handle, curl->handle);
+		curl_libevent_deactivate(self, curl);
+		break;
+	case CURL_LIBEVENT_CURL_RACING:
+		TAILQ_REMOVE(&self->racing, curl, next);
+		break;
+	case CURL_LIBEVENT_CURL_RETRYING:
+		TAILQ_REMOVE(&self->retrying, curl, next);
+		event_del(curl->ev_retry);
+		xfree(curl->ev_retry);
+		curl->ev_retry = NULL;
+		break;
+	}
+	curl->state = CURL_LIBEVENT_CURL_INIT;
+}
+
+/*
+ * Take the transfer out of wherever it is and complete it with the given
+ * result.
+ */
+void
+curl_libevent_abort(struct curl_libevent *self,
+    struct curl_libevent_curl *curl, CURLcode result)
+{
+	CURLMsg				 msg;
+
+#ifdef _WIN32
+	if (curl->state == CURL_LIBEVENT_CURL_ACTIVE && self->autoproxy &&
+	    curl->hProxyResolv != INVALID_HANDLE_VALUE) {
+		/* the resolver has the record, done after that */
+		if (curl->tag != 0) {
+			LIST_REMOVE(curl, tagged);
+			curl->tag = 0;
+		}
+		if (curl->expires != 0)
+			curl_libevent_wheel_remove(self, curl);
+		curl->aborted = result;
+		return;
+	}
+#endif
+	curl_libevent_unlink(self, curl);
+	if (curl->flight != NULL)
+		curl_libevent_flight_leave(self, curl);
+	if (curl->hedge != NULL)
+		curl_libevent_hedge_free(self, curl);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg = CURLMSG_DONE;
+	msg.easy_handle = curl->handle;
+	msg.data.result = result;
+	curl_libevent_finish(self, curl, &msg);
+}
+
+/*
+ * Cancel the transfer, whether it is active or not started yet.  on_done
+ * is called with CURLE_ABORTED_BY_CALLBACK.
+ */
+int
+curl_libevent_cancel(struct curl_libevent *self, CURL *handle)
+{
+	struct curl_libevent_curl	*curl;
+
+	if ((curl = curl_libevent_hash_find(self, handle)) == NULL)
+		return (-1);
+	self->stats.cancelled++;
+	curl_libevent_abort(self, curl, CURLE_ABORTED_BY_CALLBACK);
+
+	return (0);
+}
+
+/* Cancel all the transfers having the tag.  Returns the number of them */
+int
+curl_libevent_cancel_tag(struct curl_libevent *self, uintptr_t tag)
+{
+	struct curl_libevent_curl	*curl, *tcurl;
+	LIST_HEAD(, curl_libevent_curl)	 list;
+	int				 n = 0;
+
+	if (tag == 0)
+		return (0);
+	/* on_done may cancel others, take them out first */
+	LIST_INIT(&list);
+	LIST_FOREACH_SAFE(curl, &self->tags[curl_libevent_tag_index(tag)],
+	    tagged, tcurl) {
+		if (curl->tag == tag) {
+			LIST_REMOVE(curl, tagged);
+			LIST_INSERT_HEAD(&list, curl, tagged);
+		}
+	}
+	while ((curl = LIST_FIRST(&list)) != NULL) {
+		self->stats.cancelled++;
+		curl_libevent_abort(self, curl, CURLE_ABORTED_BY_CALLBACK);
+		n++;
+	}
+
+	return (n);
+}
+
+/*
+ * curl_libevent_submit() may be called from any thread.  The request is
+ * pushed to a lock-free multi-producer queue and the loop is woken up
+ * through a socketpair, then the loop performs the queued requests in
+ * batches.  Only the first producer after the loop started draining
+ * writes to the socketpair.
+ */
+void
+curl_libevent_submit(struct curl_libevent *self, CURL *handle,
+    void (*on_done)(void *, CURLMsg *))
+{
+	curl_libevent_submit_internal(self, handle, on_done, false);
+}
+
+void
+curl_libevent_submit_internal(struct curl_libevent *self, CURL *handle,
+    void (*on_done)(void *, CURLMsg *), bool routed)
+{
+	struct curl_libevent_submission	*sub;
+
+	sub = xcalloc(1, sizeof(*sub));
+	sub->handle = handle;
+	sub->on_done = on_done;
+	sub->routed = routed;
+	curl_libevent_subq_push(self, sub);
+	if (ATOMIC_XCHG(&self->subq_wakeup, 1) == 0)
+		send(self->subpairs[1], "", 1, 0);
+}
+
+void
+curl_libevent_on_submit(evutil_socket_t fd, short evmask, void *ctx)
+{
+	struct curl_libevent		*self = ctx;
+	struct curl_libevent_submission	*sub;
+	char				 buf[128];
+	int				 i;
+
+	while (recv(fd, buf, sizeof(buf), 0) > 0)
+		;
+	/* producers after this point wake us up again */
+	ATOMIC_XCHG(&self->subq_wakeup, 0);
+	for (i = 0; i < CURL_LIBEVENT_SUBMIT_BATCH; i++) {
+		if ((sub = curl_libevent_subq_pop(self)) == NULL)
+			return;
+		self->routing = sub->routed;
+		if (curl_libevent_perform(self, sub->handle, sub->on_done)
+		    == -1)
+			curl_libevent_reject(self, sub->handle, sub->on_done,
+			    sub->routed);
+		self->routing = false;
+		xfree(sub);
+	}
+	/* let other events run, then continue */
+	event_active(&self->ev_submit, EV_READ, 1);
+}
+
+/*
+ * The submitted request couldn't be queued.  Complete it with CURLE_AGAIN
+ * since the caller of curl_libevent_submit() can't see the failure.
+ */
+void
+curl_libevent_reject(struct curl_libevent *self, CURL *handle,
+    void (*on_done)(void *, CURLMsg *), bool routed)
+{
+	CURLMsg		 msg;
+	void		*ctx = NULL;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg = CURLMSG_DONE;
+	msg.easy_handle = handle;
+	msg.data.result = CURLE_AGAIN;
+	curl_easy_getinfo(handle, CURLINFO_PRIVATE, &ctx);
+	if (on_done && self->executor != NULL)
+		curl_libevent_executor_push(self, ctx, on_done, &msg, handle,
+		    NULL);
+	else if (on_done)
+		on_done(ctx, &msg);
+	else if (self->batch_done != NULL)
+		curl_libevent_batch_add(self, ctx, handle, msg.data.result, NULL);
+	else
+		curl_libevent_easy_put(self, handle);
+	if (routed && self->on_complete != NULL)
+		self->on_complete(self, self->on_complete_arg);
+}
+
+/*
+ * Intrusive MPSC queue by Dmitry Vyukov.  Producers swap the head and
+ * link the previous one; the consumer follows the links from the tail.
+ */
+void
+curl_libevent_subq_push(struct curl_libevent *self,
+    struct curl_libevent_submission *sub)
+{
+	struct curl_libevent_submission	*prev;
+
+	ATOMIC_STORE_PTR(&sub->next, NULL);
+	prev = ATOMIC_XCHG_PTR(&self->subq_head, sub);
+	ATOMIC_STORE_PTR(&prev->next, sub);
+}
+
+struct curl_libevent_submission *
+curl_libevent_subq_pop(struct curl_libevent *self)
+{
+	struct curl_libevent_submission	*tail = self->subq_tail, *next;
+
+	next = ATOMIC_LOAD_PTR(&tail->next);
+	if (tail == self->subq_stub) {
+		if (next == NULL)
+			return (NULL);
+		self->subq_tail = tail = next;
+		next = ATOMIC_LOAD_PTR(&tail->next);
+	}
+	if (next != NULL) {
+		self->subq_tail = next;
+		return (tail);
+	}
+	if (tail != ATOMIC_LOAD_PTR(&self->subq_head))
+		/* a producer is in the middle of the push; it wakes us up */
+		return (NULL);
+	curl_libevent_subq_push(self, self->subq_stub);
+	if ((next = ATOMIC_LOAD_PTR(&tail->next)) != NULL) {
+		self->subq_tail = next;
+		return (tail);
+	}
+
+	return (NULL);
+}
+
+void
+curl_libevent_on_event(int fd, short evmask, void *ctx)
+{
+	struct curl_libevent_sock
+			*self = ctx;
+	struct curl_libevent
+			*parent;
+	int		 flags = 0, running_handles = 0;
+
+	if (evmask & EV_READ)
+		flags |= CURL_CSELECT_IN;
+	if (evmask & EV_WRITE)
+		flags |= CURL_CSELECT_OUT;
+
+	parent = self->parent;
+	curl_multi_socket_action(self->parent->handle, self->sock, flags,
+	    &running_handles);
+	self = NULL;	/* self may be destroyed */
+	curl_libevent_drain(parent);
+}
+
+void
+curl_libevent_on_timer(int fd, short evmask, void *ctx)
+{
+	struct curl_libevent	*self = ctx;
+	int			 running_handles;
+
+	evutil_timerclear(&self->timer_at);
+	curl_multi_socket_action(self->handle, CURL_SOCKET_TIMEOUT, 0,
+	    &running_handles);
+
+	curl_libevent_drain(self);
+}
+
+void
+curl_libevent_drain(struct curl_libevent *self)
+{
+	if (!self->deferred)
+		curl_libevent_events(self);
+	else if (!self->dirty) {
+		self->dirty = true;
+		event_active(&self->ev_drain, EV_TIMEOUT, 1);
+	}
+}
+
+void
+curl_libevent_on_drain(int fd, short evmask, void *ctx)
+{
+	struct curl_libevent	*self = ctx;
+
+	self->dirty = false;
+	curl_libevent_events(self);
+}
+
+void
+curl_libevent_events(struct curl_libevent *self)
 {
 	int				 pending = 0;
 	CURLMsg				*msg;
-	void				*ctx = NULL;
 	struct curl_libevent_curl	*curl;
+	bool				 in_events = self->in_events;
 
+	self->in_events = true;
 	while ((msg = curl_multi_info_read(self->handle, &pending)) ) {
 		switch (msg->msg) {
 		case CURLMSG_DONE:
 			curl_multi_remove_handle(self->handle,
 			    msg->easy_handle);
-			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE,
-			    &ctx);
-			TAILQ_FOREACH(curl, &self->curls, next) {
-				if (curl->handle == msg->easy_handle)
-					break;
-			}
-			if (curl) {
-				TAILQ_REMOVE(&self->curls, curl, next);
-				if (curl->on_done)
-					curl->on_done(ctx, msg);
-				else
-					curl_easy_cleanup(msg->easy_handle);
-				freezero(curl, sizeof(*curl));
-			} else {
+			curl = curl_libevent_hash_find(self, msg->easy_handle);
+			if (self->share != NULL)
+				curl_libevent_share_account(self->share,
+				    msg->easy_handle);
+			if (curl && curl->host != NULL &&
+			    msg->data.result == CURLE_OK)
+				curl_libevent_host_account(curl->host,
+				    msg->easy_handle);
+			if (curl && curl->host != NULL)
+				curl_libevent_breaker_account(self, curl, msg);
+			if (curl)
+				curl_libevent_limit_account(self, curl, msg);
+			if (curl && curl_libevent_retry_schedule(self, curl,
+			    msg))
+				;	/* backing off */
+			else if (curl && curl->hedge != NULL)
+				curl_libevent_hedge_done(self, curl, msg);
+			else if (curl)
+				curl_libevent_finish(self, curl, msg);
+			else {
 				/* must not happen */
 				warnx("Received a message for an "
 				    "unknown curl easy handle");
@@ -311,6 +1987,9 @@ curl_libevent_events(struct curl_libevent *self)
 			break;
 		}
 	}
+	self->in_events = in_events;
+	if (!in_events)
+		curl_libevent_batch_flush(self);
 }
 
 void
@@ -318,25 +1997,137 @@ curl_libevent_destroy(struct curl_libevent *self)
 {
 	struct curl_libevent_sock	*sock, *tsock;
 	struct curl_libevent_curl	*curl, *tcurl;
+	struct curl_libevent_submission	*sub;
+	struct curl_libevent_tenant	*tenant;
+	struct curl_libevent_bucket	*bucket;
+	struct curl_libevent_flight	*flight;
+	struct curl_libevent_cache_entry
+					*entry;
+	struct curl_libevent_host	*host;
+	int				 i, prio;
+	unsigned			 j;
 
+	/* the workers may submit until they are stopped */
+	if (self->executor != NULL)
+		curl_libevent_executor_stop(self);
+	while ((sub = curl_libevent_subq_pop(self)) != NULL) {
+		curl_easy_cleanup(sub->handle);
+		xfree(sub);
+	}
+	while (self->neasy_pool > 0)
+		curl_easy_cleanup(self->easy_pool[--self->neasy_pool]);
+	xfree(self->easy_pool);
+	xfree(self->subq_stub);
+	if (self->subpairs[0] != -1) {
+		event_del(&self->ev_submit);
+		evutil_closesocket(self->subpairs[0]);
+		evutil_closesocket(self->subpairs[1]);
+	}
 	TAILQ_FOREACH_SAFE(curl, &self->curls, next, tcurl) {
 		TAILQ_REMOVE(&self->curls, curl, next);
 		curl_multi_remove_handle(self->handle, curl->handle);
-		curl_easy_cleanup(curl->handle);
 #ifdef _WIN32
 		if (curl->hProxyResolv != INVALID_HANDLE_VALUE)
 			WinHttpCloseHandle(curl->hProxyResolv);
 #endif
-		freezero(curl, sizeof(*curl));
+		curl_libevent_curl_discard(curl);
+	}
+	while ((curl = TAILQ_FIRST(&self->hits)) != NULL) {
+		TAILQ_REMOVE(&self->hits, curl, next);
+		curl_libevent_curl_discard(curl);
+	}
+	while ((curl = TAILQ_FIRST(&self->racing)) != NULL) {
+		TAILQ_REMOVE(&self->racing, curl, next);
+		curl_libevent_curl_discard(curl);
+	}
+	while ((curl = TAILQ_FIRST(&self->retrying)) != NULL) {
+		TAILQ_REMOVE(&self->retrying, curl, next);
+		curl_libevent_curl_discard(curl);
+	}
+	while ((entry = TAILQ_FIRST(&self->cache_lru)) != NULL)
+		curl_libevent_cache_remove(self, entry);
+	for (i = 0; i < CURL_LIBEVENT_HOST_HASHSIZ; i++) {
+		while ((host = LIST_FIRST(&self->hosts[i])) != NULL) {
+			LIST_REMOVE(host, hash);
+			while ((curl = TAILQ_FIRST(&host->throttled)) != NULL) {
+				TAILQ_REMOVE(&host->throttled, curl, next);
+				curl_libevent_curl_discard(curl);
+			}
+			xfree(host->name);
+			xfree(host);
+		}
+	}
+	for (i = 0; i < CURL_LIBEVENT_BUCKET_HASHSIZ; i++) {
+		while ((bucket = LIST_FIRST(&self->buckets[i])) != NULL) {
+			LIST_REMOVE(bucket, hash);
+			event_del(&bucket->ev_timer);
+			while ((curl = TAILQ_FIRST(&bucket->waiting)) != NULL) {
+				TAILQ_REMOVE(&bucket->waiting, curl, next);
+				curl_libevent_curl_discard(curl);
+			}
+			xfree(bucket->key);
+			xfree(bucket);
+		}
+	}
+	for (i = 0; i < CURL_LIBEVENT_FLIGHT_HASHSIZ; i++) {
+		while ((flight = LIST_FIRST(&self->flights[i])) != NULL) {
+			LIST_REMOVE(flight, hash);
+			while ((curl = TAILQ_FIRST(&flight->waiters)) != NULL) {
+				TAILQ_REMOVE(&flight->waiters, curl, next);
+				curl_libevent_curl_discard(curl);
+			}
+			xfree(flight->key);
+			xfree(flight);
+		}
+	}
+	for (i = 0; i < CURL_LIBEVENT_TENANT_HASHSIZ; i++) {
+		while ((tenant = LIST_FIRST(&self->tenants[i])) != NULL) {
+			LIST_REMOVE(tenant, hash);
+			for (prio = 0; prio < CURL_LIBEVENT_NPRIO; prio++) {
+				while ((curl = TAILQ_FIRST(
+				    &tenant->pending[prio])) != NULL) {
+					TAILQ_REMOVE(&tenant->pending[prio],
+					    curl, next);
+					curl_libevent_curl_discard(curl);
+				}
+			}
+			xfree(tenant);
+		}
+	}
+	while ((curl = TAILQ_FIRST(&self->curl_pool)) != NULL) {
+		TAILQ_REMOVE(&self->curl_pool, curl, next);
+		xfree(curl);
 	}
 	curl_multi_cleanup(self->handle);
 
 	event_del(&self->ev_timer);
+	event_del(&self->ev_drain);
+	event_del(&self->ev_shaper);
+	event_del(&self->ev_wheel);
+	event_del(&self->ev_hits);
+	event_del(&self->ev_batch);
+	for (i = 0; i < 2; i++) {
+		/* never delivered */
+		for (j = 0; j < self->batches[i].n; j++) {
+			curl_easy_cleanup(self->batches[i].recs[j].easy);
+			if (self->batches[i].bodies[j] != NULL)
+				curl_libevent_body_unref(
+				    self->batches[i].bodies[j]);
+		}
+		xfree(self->batches[i].recs);
+		xfree(self->batches[i].bodies);
+	}
 	TAILQ_FOREACH_SAFE(sock, &self->socks, next, tsock) {
 		TAILQ_REMOVE(&self->socks, sock, next);
 		event_del(&sock->ev_sock);
 		freezero(sock, sizeof(*sock));
 	}
+	while ((sock = TAILQ_FIRST(&self->sock_pool)) != NULL) {
+		TAILQ_REMOVE(&self->sock_pool, sock, next);
+		xfree(sock);
+	}
+	xfree(self->hash);
+	evutil_monotonic_timer_free(self->clock);
 
 #ifdef _WIN32
 	if (self->hHttpSession != INVALID_HANDLE_VALUE)
@@ -371,7 +2162,8 @@ curl_libevent_set_events(CURL *easy, curl_socket_t sock, int action,
 		if (self) {
 			TAILQ_REMOVE(&parent->socks, self, next);
 			event_del(&self->ev_sock);
-			freezero(self, sizeof(*self));
+			parent->stats.sock_updates++;
+			curl_libevent_sock_free(parent, self);
 			curl_multi_assign(parent->handle, sock, NULL);
 		}
 		return (0);
@@ -379,18 +2171,31 @@ curl_libevent_set_events(CURL *easy, curl_socket_t sock, int action,
 		abort();
 
 	if (self == NULL) {
-		self = xcalloc(1, sizeof(*self));
+		self = curl_libevent_sock_alloc(parent);
 		self->sock = sock;
 		self->parent = parent;
 		TAILQ_INSERT_TAIL(&parent->socks, self, next);
 		curl_multi_assign(parent->handle, sock, self);
-	} else
+	} else if (self->evmask == evmask) {
+		parent->stats.sock_unchanged++;
+		return (0);	/* nothing changed */
+	} else {
+		/*
+		 * The event must not be pending when it is set again.  With
+		 * epoll this is EPOLL_CTL_DEL and EPOLL_CTL_ADD, unless the
+		 * base is created with EVENT_BASE_FLAG_EPOLL_USE_CHANGELIST,
+		 * which folds the pair into one EPOLL_CTL_MOD.
+		 */
 		event_del(&self->ev_sock);
+		parent->stats.sock_updates++;
+	}
 
 	event_set(&self->ev_sock, sock, evmask, curl_libevent_on_event, self);
 	if (parent->eb != NULL)
 		event_base_set(parent->eb, &self->ev_sock);
 	event_add(&self->ev_sock, NULL);
+	parent->stats.sock_updates++;
+	self->evmask = evmask;
 
 	return (0);
 }
@@ -399,84 +2204,2971 @@ int
 curl_libevent_set_timer(CURLM *multi, long timeout_ms, void *userp)
 {
 	struct curl_libevent	*self = userp;
-	struct timeval		 tv;
+	struct timeval		 tv, now, next, diff;
 
-	if (timeout_ms >= 0) {
-		tv.tv_sec = timeout_ms / 1000;
-		tv.tv_usec = (timeout_ms % 1000) * 1000UL;
+	if (timeout_ms < 0) {
 		event_del(&self->ev_timer);
-		event_add(&self->ev_timer, &tv);
-	} else
+		evutil_timerclear(&self->timer_at);
+		return (0);
+	}
+	if (timeout_ms == 0) {
+		/*
+		 * libcurl wants this right after curl_multi_add_handle().
+		 * Run the timer in this loop iteration without going through
+		 * the timer heap.
+		 */
 		event_del(&self->ev_timer);
+		evutil_timerclear(&self->timer_at);
+		event_active(&self->ev_timer, EV_TIMEOUT, 1);
+		return (0);
+	}
+	tv.tv_sec = timeout_ms / 1000;
+	tv.tv_usec = (timeout_ms % 1000) * 1000UL;
+	curl_libevent_now(self, &now);
+	evutil_timeradd(&now, &tv, &next);
+	if (evutil_timerisset(&self->timer_at)) {
+		/* leave the timer alone if the deadline is the same */
+		if (evutil_timercmp(&self->timer_at, &next, <))
+			evutil_timersub(&next, &self->timer_at, &diff);
+		else
+			evutil_timersub(&self->timer_at, &next, &diff);
+		if (diff.tv_sec == 0 && diff.tv_usec < 1000)
+			return (0);
+	}
+	event_del(&self->ev_timer);
+	event_add(&self->ev_timer, &tv);
+	self->timer_at = next;
 
 	return (0);
 }
 
-#ifndef _WIN32
-void *
-curl_libevent_xcalloc(size_t nmemb, size_t size)
+/*
+ * Index of the curls by the easy handle.  Looking up the record for a
+ * CURLMSG_DONE must not depend on the number of transfers in flight, and
+ * CURLOPT_PRIVATE belongs to the user, so keep a chained hash keyed by
+ * the handle pointer.  The table doubles when the load exceeds 1.
+ */
+static unsigned
+curl_libevent_hash_index(int bits, CURL *handle)
 {
-	void	*ret = calloc(nmemb, size);
-	if (ret == NULL)
-		err(1, "calloc");
-	return (ret);
+	uint64_t	 h = (uint64_t)(uintptr_t)handle;
+
+	/* Fibonacci hashing; use the upper bits */
+	return ((unsigned)((h * 0x9E3779B97F4A7C15ULL) >> (64 - bits)));
+}
+
+unsigned
+curl_libevent_tag_index(uintptr_t tag)
+{
+	return ((unsigned)(((uint64_t)tag * 0x9E3779B97F4A7C15ULL) >>
+	    (64 - CURL_LIBEVENT_TAG_HASHBITS)));
 }
-#endif
 
-#ifdef _WIN32
 void
-curl_libevent_winhttp_callback(HINTERNET hInternet, DWORD_PTR dwContext,
-    DWORD dwInternetStatus, LPVOID lpvStatusInformation,
-    DWORD dwStatusInformationLength)
+curl_libevent_hash_resize(struct curl_libevent *self, int nbits)
 {
+	struct curl_libevent_hash	*nhash;
 	struct curl_libevent_curl	*curl;
-	struct curl_libevent		*self;
-	struct pair_event		 ev;
+	int				 i;
 
-	curl = dwContext;
-	self = curl->parent;
-	ev.context = dwContext;
-	if (dwInternetStatus == WINHTTP_CALLBACK_STATUS_GETPROXYFORURL_COMPLETE)
-		ev.dwError = NO_ERROR;
-	else if (dwInternetStatus == WINHTTP_CALLBACK_STATUS_REQUEST_ERROR)
-		ev.dwError = ((PWINHTTP_ASYNC_RESULT)lpvStatusInformation)->dwError;
-	send(self->pairs[1], &ev, sizeof(ev), 0);
+	nhash = xcalloc(1U << nbits, sizeof(nhash[0]));
+	for (i = 0; i < (1 << self->hashbits); i++) {
+		while ((curl = LIST_FIRST(&self->hash[i])) != NULL) {
+			LIST_REMOVE(curl, hash);
+			LIST_INSERT_HEAD(&nhash[curl_libevent_hash_index(nbits,
+			    curl->handle)], curl, hash);
+		}
+	}
+	xfree(self->hash);
+	self->hash = nhash;
+	self->hashbits = nbits;
 }
 
 void
-curl_libevent_on_pairs_event(intptr_t fd, short ev0, void *ctx)
+curl_libevent_hash_insert(struct curl_libevent *self,
+    struct curl_libevent_curl *curl)
+{
+	if (self->ncurls >= (1U << self->hashbits))
+		curl_libevent_hash_resize(self, self->hashbits + 1);
+	LIST_INSERT_HEAD(&self->hash[curl_libevent_hash_index(self->hashbits,
+	    curl->handle)], curl, hash);
+	self->ncurls++;
+}
+
+void
+curl_libevent_hash_remove(struct curl_libevent *self,
+    struct curl_libevent_curl *curl)
+{
+	LIST_REMOVE(curl, hash);
+	self->ncurls--;
+}
+
+struct curl_libevent_curl *
+curl_libevent_hash_find(struct curl_libevent *self, CURL *handle)
 {
-	struct pair_event		 ev;
-	SSIZE_T				 sz;
-	struct curl_libevent		*self = ctx;
 	struct curl_libevent_curl	*curl;
-	WINHTTP_PROXY_RESULT		 proxyResult;
-	char				*proxy;
-	size_t				 proxylen;
 
-	if ((sz = recv(fd, &ev, sizeof(ev), 0)) == -1)
-		warnx("%s; recv() failed: %u", WSAGetLastError());
-	if (sz != sizeof(ev)) {
-		warnx("%s; recv() wrong size: %zd", sz);
+	LIST_FOREACH(curl, &self->hash[curl_libevent_hash_index(
+	    self->hashbits, handle)], hash) {
+		if (curl->handle == handle)
+			return (curl);
+	}
+	return (NULL);
+}
+
+/*
+ * Per instance free lists of the records.  The "next" entry links the
+ * free records since they are on neither the curls nor the socks.
+ */
+struct curl_libevent_curl *
+curl_libevent_curl_alloc(struct curl_libevent *self)
+{
+	struct curl_libevent_curl	*curl;
+
+	if ((curl = TAILQ_FIRST(&self->curl_pool)) == NULL)
+		curl = xcalloc(1, sizeof(*curl));
+	else {
+		TAILQ_REMOVE(&self->curl_pool, curl, next);
+		self->ncurl_pool--;
+		memset(curl, 0, sizeof(*curl));
+	}
+#ifdef _WIN32
+	curl->hProxyResolv = INVALID_HANDLE_VALUE;
+#endif
+
+	return (curl);
+}
+
+void
+curl_libevent_curl_free(struct curl_libevent *self,
+    struct curl_libevent_curl *curl)
+{
+	struct curl_libevent_tenant	*tenant;
+
+	if ((tenant = curl->tenant) != NULL) {
+		curl->tenant = NULL;
+		tenant->refs--;
+		curl_libevent_tenant_put(self, tenant);
+	}
+	if (curl->host != NULL) {
+		curl_libevent_host_unref(self, curl->host);
+		curl->host = NULL;
+	}
+	if (self->ncurl_pool >= self->curl_pool_max) {
+		freezero(curl, sizeof(*curl));
 		return;
 	}
-	curl = ev.context;
-	if (ev.dwError != NO_ERROR) {
-		warnx("%s: GetProxy failed %u", __func__, ev.dwError);
-		goto out;
+	if (self->pool_zero)
+		memset(curl, 0, sizeof(*curl));
+	TAILQ_INSERT_HEAD(&self->curl_pool, curl, next);
+	self->ncurl_pool++;
+}
+
+/* Release the record and the handle without calling back */
+void
+curl_libevent_curl_discard(struct curl_libevent_curl *curl)
+{
+	struct curl_libevent_hedge	*hedge;
+	struct curl_libevent_curl	*dup;
+	unsigned			 i;
+
+	if ((hedge = curl->hedge) != NULL) {
+		if (hedge->primary == curl) {
+			event_del(&hedge->ev_timer);
+			LIST_FOREACH(dup, &hedge->dups, hedged)
+				dup->hedge = NULL;
+			for (i = 0; i < hedge->nurls; i++)
+				xfree(hedge->urls[i]);
+			xfree(hedge->urls);
+			xfree(hedge);
+		} else {
+			LIST_REMOVE(curl, hedged);
+			hedge->ndups--;
+		}
 	}
-	memset(&proxyResult, 0, sizeof(proxyResult));
-	WinHttpGetProxyResult(curl->hProxyResolv, &proxyResult);
-	if (proxyResult.cEntries <= 0) {
-		warnx("%s: cEntries=%d", __func__, proxyResult.cEntries);
-		goto out;
+	if (curl->ev_retry != NULL) {
+		event_del(curl->ev_retry);
+		xfree(curl->ev_retry);
 	}
-	WINHTTP_PROXY_RESULT_ENTRY *result = &proxyResult.pEntries[0];
-	if (result->fProxy && !result->fBypass) {
-		proxylen = wcslen(result->pwszProxy);
-		proxy = xcalloc(1, proxylen + 1);
-		WideCharToMultiByte(CP_UTF8, 0, result->pwszProxy, -1,
-		    proxy, proxylen + 1, NULL, FALSE);
+	curl_easy_cleanup(curl->handle);
+	if (curl->body != NULL)
+		curl_libevent_body_unref(curl->body);
+	if (curl->cached != NULL)
+		curl_libevent_body_unref(curl->cached);
+	curl_slist_free_all(curl->cond_headers);
+	xfree(curl->cache_key);
+	freezero(curl, sizeof(*curl));
+}
+
+struct curl_libevent_sock *
+curl_libevent_sock_alloc(struct curl_libevent *self)
+{
+	struct curl_libevent_sock	*sock;
+
+	if ((sock = TAILQ_FIRST(&self->sock_pool)) == NULL)
+		return (xcalloc(1, sizeof(*sock)));
+	TAILQ_REMOVE(&self->sock_pool, sock, next);
+	self->nsock_pool--;
+	memset(sock, 0, sizeof(*sock));
+
+	return (sock);
+}
+
+void
+curl_libevent_sock_free(struct curl_libevent *self,
+    struct curl_libevent_sock *sock)
+{
+	if (self->nsock_pool >= self->sock_pool_max) {
+		freezero(sock, sizeof(*sock));
+		return;
+	}
+	if (self->pool_zero)
+		memset(sock, 0, sizeof(*sock));
+	TAILQ_INSERT_HEAD(&self->sock_pool, sock, next);
+	self->nsock_pool++;
+}
+
+/************************************************************************
+ * tenants
+ ************************************************************************/
+/*
+ * The pending transfers are queued per tenant and the tenants share the
+ * active slots by deficit round robin: a backlogged tenant earns its
+ * weight each round and spends 1 for each transfer started.  Within a
+ * tenant, the higher priority class is started first.  A tenant is
+ * created by the first transfer of the id and, unless configured by
+ * curl_libevent_set_tenant(), released with its stats when no transfer
+ * refers it, so that the ids used once don't pile up.
+ */
+void
+curl_libevent_set_tenant(struct curl_libevent *self, unsigned id,
+    unsigned weight, unsigned max_active, unsigned max_pending)
+{
+	struct curl_libevent_tenant	*tenant;
+
+	tenant = curl_libevent_tenant_get(self, id);
+	tenant->configured = true;
+	tenant->weight = (weight > 0)? weight : 1;
+	tenant->max_active = max_active;
+	tenant->max_pending = max_pending;
+	curl_libevent_promote(self);
+}
+
+int
+curl_libevent_get_tenant_stats(struct curl_libevent *self, unsigned id,
+    struct curl_libevent_tenant_stats *stats)
+{
+	struct curl_libevent_tenant	*tenant;
+
+	LIST_FOREACH(tenant, &self->tenants[id % CURL_LIBEVENT_TENANT_HASHSIZ],
+	    hash) {
+		if (tenant->id == id) {
+			*stats = tenant->stats;
+			stats->active = tenant->nactive;
+			stats->pending = tenant->npending;
+			return (0);
+		}
+	}
+
+	return (-1);
+}
+
+struct curl_libevent_tenant *
+curl_libevent_tenant_get(struct curl_libevent *self, unsigned id)
+{
+	struct curl_libevent_tenant	*tenant;
+	int				 i;
+
+	LIST_FOREACH(tenant, &self->tenants[id % CURL_LIBEVENT_TENANT_HASHSIZ],
+	    hash) {
+		if (tenant->id == id)
+			return (tenant);
+	}
+	tenant = xcalloc(1, sizeof(*tenant));
+	tenant->id = id;
+	tenant->weight = 1;
+	for (i = 0; i < CURL_LIBEVENT_NPRIO; i++)
+		TAILQ_INIT(&tenant->pending[i]);
+	LIST_INSERT_HEAD(&self->tenants[id % CURL_LIBEVENT_TENANT_HASHSIZ],
+	    tenant, hash);
+
+	return (tenant);
+}
+
+/* Release the tenant not configured if no record refers it */
+void
+curl_libevent_tenant_put(struct curl_libevent *self,
+    struct curl_libevent_tenant *tenant)
+{
+	if (tenant->refs > 0 || tenant->configured)
+		return;
+	LIST_REMOVE(tenant, hash);
+	xfree(tenant);
+}
+
+void
+curl_libevent_tenant_enqueue(struct curl_libevent *self,
+    struct curl_libevent_curl *curl)
+{
+	struct curl_libevent_tenant	*tenant = curl->tenant;
+
+	curl->state = CURL_LIBEVENT_CURL_PENDING;
+	curl_libevent_now(self, &curl->queued_at);
+	TAILQ_INSERT_TAIL(&tenant->pending[curl->priority], curl, next);
+	if (tenant->npending++ == 0) {
+		tenant->deficit = 0;
+		TAILQ_INSERT_TAIL(&self->backlog, tenant, backlog);
+	}
+	self->npending++;
+}
+
+/* Take the next transfer to start, NULL if no tenant can start one */
+struct curl_libevent_curl *
+curl_libevent_tenant_dequeue(struct curl_libevent *self)
+{
+	struct curl_libevent_tenant	*tenant;
+	struct curl_libevent_curl	*curl = NULL;
+	struct timeval			 now, wait;
+	uint64_t			 usec;
+	unsigned			 i, n = 0;
+	int				 prio;
+
+	TAILQ_FOREACH(tenant, &self->backlog, backlog)
+		n++;
+	/* a tenant which is not capped is served within two rounds */
+	for (i = 0; i < 2 * n; i++) {
+		tenant = TAILQ_FIRST(&self->backlog);
+		if (tenant->max_active > 0 &&
+		    tenant->nactive >= tenant->max_active) {
+			TAILQ_REMOVE(&self->backlog, tenant, backlog);
+			TAILQ_INSERT_TAIL(&self->backlog, tenant, backlog);
+			continue;
+		}
+		if (tenant->deficit < 1) {
+			tenant->deficit += tenant->weight;
+			TAILQ_REMOVE(&self->backlog, tenant, backlog);
+			TAILQ_INSERT_TAIL(&self->backlog, tenant, backlog);
+			continue;
+		}
+		for (prio = CURL_LIBEVENT_NPRIO - 1; prio >= 0; prio--) {
+			if ((curl = TAILQ_FIRST(&tenant->pending[prio])) !=
+			    NULL)
+				break;
+		}
+		TAILQ_REMOVE(&tenant->pending[prio], curl, next);
+		tenant->deficit--;
+		if (--tenant->npending == 0)
+			TAILQ_REMOVE(&self->backlog, tenant, backlog);
+		self->npending--;
+
+		curl_libevent_now(self, &now);
+		evutil_timersub(&now, &curl->queued_at, &wait);
+		usec = (uint64_t)wait.tv_sec * 1000000 + wait.tv_usec;
+		tenant->stats.waited++;
+		tenant->stats.wait_usec += usec;
+		if (usec > tenant->stats.wait_usec_max)
+			tenant->stats.wait_usec_max = usec;
+		return (curl);
+	}
+
+	return (NULL);
+}
+
+/************************************************************************
+ * rate limiter
+ ************************************************************************/
+/*
+ * Token buckets per key, the host name of the URL unless the attribute
+ * gives one.  A request finding no token waits in the queue of the bucket
+ * and is released by the timer of the bucket when a token is refilled,
+ * then goes through the concurrency limits as usual.  The buckets of the
+ * default limit are kept in the LRU order and the idle ones refilled to
+ * full, which a new bucket would be the same as, are released when
+ * another one is created.
+ */
+void
+curl_libevent_set_rate_limit(struct curl_libevent *self, const char *key,
+    double rate, unsigned burst)
+{
+	struct curl_libevent_bucket	*bucket;
+
+	if (burst < 1)
+		burst = 1;
+	if (key == NULL) {
+		/* the default for the keys without their own limit */
+		self->bucket_rate = rate;
+		self->bucket_burst = burst;
+		return;
+	}
+	if ((bucket = curl_libevent_bucket_get(self, key, true)) == NULL)
+		return;
+	if (!bucket->configured) {
+		TAILQ_REMOVE(&self->bucket_lru, bucket, lru);
+		bucket->configured = true;
+	}
+	/* start with a full bucket */
+	bucket->rate = rate;
+	bucket->burst = bucket->tokens = burst;
+	if (!TAILQ_EMPTY(&bucket->waiting))
+		curl_libevent_bucket_on_timer(-1, EV_TIMEOUT, bucket);
+}
+
+struct curl_libevent_bucket *
+curl_libevent_bucket_get(struct curl_libevent *self, const char *key,
+    bool create)
+{
+	struct curl_libevent_bucket	*bucket;
+	unsigned			 idx;
+	size_t				 keylen;
+
+	idx = curl_libevent_strhash(key) % CURL_LIBEVENT_BUCKET_HASHSIZ;
+	LIST_FOREACH(bucket, &self->buckets[idx], hash) {
+		if (strcmp(bucket->key, key) == 0) {
+			if (!bucket->configured) {
+				TAILQ_REMOVE(&self->bucket_lru, bucket, lru);
+				TAILQ_INSERT_TAIL(&self->bucket_lru, bucket,
+				    lru);
+			}
+			return (bucket);
+		}
+	}
+	if (!create && self->bucket_rate <= 0)
+		return (NULL);
+	while ((bucket = TAILQ_FIRST(&self->bucket_lru)) != NULL &&
+	    TAILQ_EMPTY(&bucket->waiting)) {
+		curl_libevent_bucket_refill(bucket);
+		if (bucket->tokens < bucket->burst)
+			break;
+		curl_libevent_bucket_free(self, bucket);
+	}
+
+	keylen = strlen(key);
+	bucket = xcalloc(1, sizeof(*bucket));
+	bucket->key = xcalloc(1, keylen + 1);
+	memcpy(bucket->key, key, keylen);
+	bucket->parent = self;
+	bucket->rate = self->bucket_rate;
+	bucket->burst = self->bucket_burst;
+	bucket->tokens = bucket->burst;
+	curl_libevent_now(self, &bucket->refilled);
+	TAILQ_INIT(&bucket->waiting);
+	evtimer_set(&bucket->ev_timer, curl_libevent_bucket_on_timer, bucket);
+	if (self->eb != NULL)
+		event_base_set(self->eb, &bucket->ev_timer);
+	LIST_INSERT_HEAD(&self->buckets[idx], bucket, hash);
+	TAILQ_INSERT_TAIL(&self->bucket_lru, bucket, lru);
+	self->nbuckets++;
+
+	return (bucket);
+}
+
+void
+curl_libevent_bucket_free(struct curl_libevent *self,
+    struct curl_libevent_bucket *bucket)
+{
+	if (!bucket->configured)
+		TAILQ_REMOVE(&self->bucket_lru, bucket, lru);
+	LIST_REMOVE(bucket, hash);
+	event_del(&bucket->ev_timer);
+	self->nbuckets--;
+	xfree(bucket->key);
+	xfree(bucket);
+}
+
+/* Returns true if the request waits for a token */
+bool
+curl_libevent_ratelimit(struct curl_libevent *self,
+    struct curl_libevent_curl *curl, const char *key)
+{
+	struct curl_libevent_bucket	*bucket;
+	char				 host[256];
+
+	if (key == NULL) {
+		if (curl_libevent_host(curl->handle, host, sizeof(host)) != 0)
+			return (false);
+		key = host;
+	}
+	if ((bucket = curl_libevent_bucket_get(self, key, false)) == NULL ||
+	    bucket->rate <= 0)
+		return (false);
+	curl_libevent_bucket_refill(bucket);
+	if (TAILQ_EMPTY(&bucket->waiting) && bucket->tokens >= 1) {
+		bucket->tokens -= 1;
+		return (false);
+	}
+	TAILQ_INSERT_TAIL(&bucket->waiting, curl, next);
+	curl->state = CURL_LIBEVENT_CURL_WAITING;
+	curl->bucket = bucket;
+	self->stats.ratelimited++;
+	if (!evtimer_pending(&bucket->ev_timer, NULL))
+		curl_libevent_bucket_arm(bucket);
+
+	return (true);
+}
+
+void
+curl_libevent_bucket_refill(struct curl_libevent_bucket *bucket)
+{
+	struct timeval	 now, elapsed;
+
+	curl_libevent_now(bucket->parent, &now);
+	evutil_timersub(&now, &bucket->refilled, &elapsed);
+	bucket->refilled = now;
+	if (elapsed.tv_sec < 0)
+		return;
+	bucket->tokens += (elapsed.tv_sec + elapsed.tv_usec / 1000000.0) *
+	    bucket->rate;
+	if (bucket->tokens > bucket->burst)
+		bucket->tokens = bucket->burst;
+}
+
+/* Arm the timer for the next token */
+void
+curl_libevent_bucket_arm(struct curl_libevent_bucket *bucket)
+{
+	struct timeval	 tv;
+	double		 wait;
+
+	wait = (1.0 - bucket->tokens) / bucket->rate;
+	if (wait < 0)
+		wait = 0;
+	tv.tv_sec = (long)wait;
+	tv.tv_usec = (long)((wait - tv.tv_sec) * 1000000.0) + 1;
+	evtimer_add(&bucket->ev_timer, &tv);
+}
+
+void
+curl_libevent_bucket_on_timer(int fd, short evmask, void *ctx)
+{
+	struct curl_libevent_bucket	*bucket = ctx;
+	struct curl_libevent		*self = bucket->parent;
+	struct curl_libevent_curl	*curl;
+
+	curl_libevent_bucket_refill(bucket);
+	while ((curl = TAILQ_FIRST(&bucket->waiting)) != NULL) {
+		if (bucket->rate > 0) {
+			if (bucket->tokens < 1)
+				break;
+			bucket->tokens -= 1;
+		}
+		TAILQ_REMOVE(&bucket->waiting, curl, next);
+		curl->bucket = NULL;
+		curl_libevent_admit(self, curl);
+	}
+	if (!TAILQ_EMPTY(&bucket->waiting))
+		curl_libevent_bucket_arm(bucket);
+}
+
+/************************************************************************
+ * bandwidth shaping
+ ************************************************************************/
+/*
+ * One budget of bytes per second for all the transfers of the instance.
+ * libcurl doesn't let us chain the write/read callbacks set by the user,
+ * so the transfers whose callbacks are given through the attribute are
+ * shaped: the library installs its own callbacks, which return
+ * CURL_WRITEFUNC_PAUSE or CURL_READFUNC_PAUSE when the transfer has no
+ * credit left.  A periodic timer hands out the budget to the transfers
+ * in proportion to their weights and resumes them by curl_easy_pause().
+ */
+void
+curl_libevent_set_bandwidth(struct curl_libevent *self, curl_off_t recv_bps,
+    curl_off_t send_bps)
+{
+	struct curl_libevent_curl	*curl;
+
+	self->recv_limit = recv_bps;
+	self->send_limit = send_bps;
+	if (recv_bps <= 0 || send_bps <= 0) {
+		/* resume the transfers paused for the unlimited direction */
+		TAILQ_FOREACH(curl, &self->shaped, shaped) {
+			if (recv_bps <= 0)
+				curl->recv_credit = 0;
+			if (send_bps <= 0)
+				curl->send_credit = 0;
+		}
+		curl_libevent_shaper_resume(self);
+	}
+}
+
+void
+curl_libevent_get_bandwidth_stats(struct curl_libevent *self,
+    struct curl_libevent_bandwidth_stats *stats)
+{
+	*stats = self->bw;
+	stats->recv_limit = self->recv_limit;
+	stats->send_limit = self->send_limit;
+}
+
+void
+curl_libevent_shaper_add(struct curl_libevent *self,
+    struct curl_libevent_curl *curl)
+{
+	struct timeval	 tv;
+
+	TAILQ_INSERT_TAIL(&self->shaped, curl, shaped);
+	self->shaped_weight += curl->bw_weight;
+	if (!evtimer_pending(&self->ev_shaper, NULL)) {
+		tv.tv_sec = 0;
+		tv.tv_usec = CURL_LIBEVENT_SHAPER_TICK * 1000;
+		event_add(&self->ev_shaper, &tv);
+		curl_libevent_now(self, &self->bw_window);
+	}
+}
+
+void
+curl_libevent_shaper_remove(struct curl_libevent *self,
+    struct curl_libevent_curl *curl)
+{
+	TAILQ_REMOVE(&self->shaped, curl, shaped);
+	self->shaped_weight -= curl->bw_weight;
+	if (TAILQ_EMPTY(&self->shaped))
+		event_del(&self->ev_shaper);
+}
+
+size_t
+curl_libevent_shaper_write(char *ptr, size_t size, size_t nmemb, void *ctx)
+{
+	struct curl_libevent_curl	*curl = ctx;
+	struct curl_libevent		*self = curl->parent;
+	size_t				 ret;
+
+	if (self->recv_limit > 0 && curl->recv_credit <= 0) {
+		curl->paused |= CURLPAUSE_RECV;
+		self->bw.pauses++;
+		return (CURL_WRITEFUNC_PAUSE);
+	}
+	ret = curl->write_function(ptr, size, nmemb, curl->write_data);
+	if (ret != CURL_WRITEFUNC_PAUSE) {
+		/* may go below zero, the debt is paid by the next ticks */
+		curl->recv_credit -= ret;
+		self->bw.recv_bytes += ret;
+		self->bw_recv += ret;
+	}
+
+	return (ret);
+}
+
+size_t
+curl_libevent_shaper_read(char *ptr, size_t size, size_t nmemb, void *ctx)
+{
+	struct curl_libevent_curl	*curl = ctx;
+	struct curl_libevent		*self = curl->parent;
+	size_t				 ret;
+
+	if (self->send_limit > 0 && curl->send_credit <= 0) {
+		curl->paused |= CURLPAUSE_SEND;
+		self->bw.pauses++;
+		return (CURL_READFUNC_PAUSE);
+	}
+	ret = curl->read_function(ptr, size, nmemb, curl->read_data);
+	if (ret != CURL_READFUNC_PAUSE && ret != CURL_READFUNC_ABORT) {
+		curl->send_credit -= ret;
+		self->bw.send_bytes += ret;
+		self->bw_send += ret;
+	}
+
+	return (ret);
+}
+
+void
+curl_libevent_on_shaper(int fd, short evmask, void *ctx)
+{
+	struct curl_libevent		*self = ctx;
+	struct curl_libevent_curl	*curl;
+	struct timeval			 now, elapsed;
+	double				 recv_q, send_q, share, max, secs;
+
+	recv_q = (double)self->recv_limit * CURL_LIBEVENT_SHAPER_TICK / 1000;
+	send_q = (double)self->send_limit * CURL_LIBEVENT_SHAPER_TICK / 1000;
+	TAILQ_FOREACH(curl, &self->shaped, shaped) {
+		/*
+		 * Don't let an idle transfer save up more than two ticks, but
+		 * at least a full write so that it can proceed.
+		 */
+		if (self->recv_limit > 0) {
+			share = recv_q * curl->bw_weight / self->shaped_weight;
+			max = MAXIMUM(2 * share, CURL_MAX_WRITE_SIZE);
+			curl->recv_credit = MINIMUM(curl->recv_credit + share,
+			    max);
+		}
+		if (self->send_limit > 0) {
+			share = send_q * curl->bw_weight / self->shaped_weight;
+			max = MAXIMUM(2 * share, CURL_MAX_WRITE_SIZE);
+			curl->send_credit = MINIMUM(curl->send_credit + share,
+			    max);
+		}
+	}
+	curl_libevent_shaper_resume(self);
+
+	/* the achieved rates, over a second */
+	curl_libevent_now(self, &now);
+	evutil_timersub(&now, &self->bw_window, &elapsed);
+	if (elapsed.tv_sec >= 1) {
+		secs = elapsed.tv_sec + elapsed.tv_usec / 1000000.0;
+		self->bw.recv_rate = self->bw_recv / secs;
+		self->bw.send_rate = self->bw_send / secs;
+		self->bw_recv = self->bw_send = 0;
+		self->bw_window = now;
+	}
+}
+
+/* Resume the paused transfers having credit */
+void
+curl_libevent_shaper_resume(struct curl_libevent *self)
+{
+	struct curl_libevent_curl	*curl, *tcurl;
+	int				 paused;
+
+	TAILQ_FOREACH_SAFE(curl, &self->shaped, shaped, tcurl) {
+		if ((paused = curl->paused) == 0)
+			continue;
+		if ((paused & CURLPAUSE_RECV) && curl->recv_credit > 0)
+			paused &= ~CURLPAUSE_RECV;
+		if ((paused & CURLPAUSE_SEND) && curl->send_credit > 0)
+			paused &= ~CURLPAUSE_SEND;
+		if (paused != curl->paused) {
+			/* this may call the write callback for the held data */
+			curl->paused = paused;
+			curl_easy_pause(curl->handle, paused);
+		}
+	}
+}
+
+/************************************************************************
+ * deadlines
+ ************************************************************************/
+/*
+ * The elapsed times, of the deadlines and the token buckets, are taken
+ * by the monotonic clock, so that setting the system time neither fires
+ * nor holds them.
+ */
+void
+curl_libevent_now(struct curl_libevent *self, struct timeval *tv)
+{
+	evutil_gettime_monotonic(self->clock, tv);
+}
+
+/*
+ * The deadlines are kept in a hierarchical timer wheel of 1ms ticks
+ * driven by the single ev_wheel, so that adding and removing one is O(1)
+ * and doesn't grow the min-heap of libevent.  The level n has 64 slots of
+ * 64^n ticks each; when the level 0 wraps around, the slot of the upper
+ * level for the next round is moved down.
+ */
+uint64_t
+curl_libevent_wheel_ticks(struct curl_libevent *self)
+{
+	struct timeval	 now, elapsed;
+
+	curl_libevent_now(self, &now);
+	evutil_timersub(&now, &self->wheel_epoch, &elapsed);
+	if (elapsed.tv_sec < 0)
+		return (1);
+	/* starts with 1 since 0 means no deadline */
+	return ((uint64_t)elapsed.tv_sec * 1000 + elapsed.tv_usec / 1000 + 1);
+}
+
+void
+curl_libevent_wheel_insert(struct curl_libevent *self,
+    struct curl_libevent_curl *curl)
+{
+	if (self->ndeadlines++ == 0)
+		/* the wheel is empty, start from now */
+		self->wheel_now = curl_libevent_wheel_ticks(self);
+	curl_libevent_wheel_place(self, curl);
+	curl_libevent_wheel_arm(self);
+}
+
+void
+curl_libevent_wheel_place(struct curl_libevent *self,
+    struct curl_libevent_curl *curl)
+{
+	uint64_t	 when;
+	int		 level, slot;
+
+	when = MAXIMUM(curl->expires, self->wheel_now);
+	for (level = 0; level < CURL_LIBEVENT_WHEEL_LEVELS - 1; level++) {
+		if (when - self->wheel_now <
+		    1ULL << (CURL_LIBEVENT_WHEEL_BITS * (level + 1)))
+			break;
+	}
+	slot = (when >> (CURL_LIBEVENT_WHEEL_BITS * level)) &
+	    (CURL_LIBEVENT_WHEEL_SLOTS - 1);
+	curl->wheel_level = level;
+	curl->wheel_slot = slot;
+	LIST_INSERT_HEAD(&self->wheel[level][slot], curl, wheel);
+	self->wheel_bitmap[level] |= 1ULL << slot;
+}
+
+void
+curl_libevent_wheel_remove(struct curl_libevent *self,
+    struct curl_libevent_curl *curl)
+{
+	LIST_REMOVE(curl, wheel);
+	if (LIST_EMPTY(&self->wheel[curl->wheel_level][curl->wheel_slot]))
+		self->wheel_bitmap[curl->wheel_level] &=
+		    ~(1ULL << curl->wheel_slot);
+	curl->expires = 0;
+	if (--self->ndeadlines == 0)
+		event_del(&self->ev_wheel);
+}
+
+/* Arm ev_wheel for the next slot having deadlines or the next round */
+void
+curl_libevent_wheel_arm(struct curl_libevent *self)
+{
+	struct timeval	 tv;
+	uint64_t	 bits, at, now;
+	int		 idx;
+
+	if (self->ndeadlines == 0)
+		return;
+	idx = self->wheel_now & (CURL_LIBEVENT_WHEEL_SLOTS - 1);
+	bits = self->wheel_bitmap[0] & (~0ULL << idx);
+	at = (self->wheel_now & ~(uint64_t)(CURL_LIBEVENT_WHEEL_SLOTS - 1)) +
+	    ((bits != 0)? CTZ64(bits) : CURL_LIBEVENT_WHEEL_SLOTS);
+	if (evtimer_pending(&self->ev_wheel, NULL) && at == self->wheel_next)
+		return;
+	self->wheel_next = at;
+	now = curl_libevent_wheel_ticks(self);
+	at = (at > now)? at - now : 0;
+	tv.tv_sec = at / 1000;
+	tv.tv_usec = (at % 1000) * 1000;
+	evtimer_add(&self->ev_wheel, &tv);
+}
+
+void
+curl_libevent_on_wheel(int fd, short evmask, void *ctx)
+{
+	struct curl_libevent		*self = ctx;
+	struct curl_libevent_curl	*curl;
+	uint64_t			 now, bits, next;
+	int				 idx, level, slot;
+
+	now = curl_libevent_wheel_ticks(self);
+	while (self->ndeadlines > 0 && self->wheel_now <= now) {
+		idx = self->wheel_now & (CURL_LIBEVENT_WHEEL_SLOTS - 1);
+		for (level = 1; idx == 0 && level < CURL_LIBEVENT_WHEEL_LEVELS;
+		    level++) {
+			slot = (self->wheel_now >>
+			    (CURL_LIBEVENT_WHEEL_BITS * level)) &
+			    (CURL_LIBEVENT_WHEEL_SLOTS - 1);
+			while ((curl = LIST_FIRST(&self->wheel[level][slot]))
+			    != NULL) {
+				LIST_REMOVE(curl, wheel);
+				curl_libevent_wheel_place(self, curl);
+			}
+			self->wheel_bitmap[level] &= ~(1ULL << slot);
+			if (slot != 0)
+				break;
+		}
+		/* on_done may add a deadline, even in this slot */
+		while ((curl = LIST_FIRST(&self->wheel[0][idx])) != NULL) {
+			curl_libevent_wheel_remove(self, curl);
+			curl_libevent_abort(self, curl,
+			    CURLE_OPERATION_TIMEDOUT);
+		}
+		if (self->wheel_now > now)
+			break;	/* restarted by on_done */
+		/* skip the empty slots */
+		idx = self->wheel_now & (CURL_LIBEVENT_WHEEL_SLOTS - 1);
+		bits = self->wheel_bitmap[0] & ~((2ULL << idx) - 1);
+		next = (self->wheel_now &
+		    ~(uint64_t)(CURL_LIBEVENT_WHEEL_SLOTS - 1)) +
+		    ((bits != 0)? CTZ64(bits) : CURL_LIBEVENT_WHEEL_SLOTS);
+		self->wheel_now = MINIMUM(next, now + 1);
+	}
+	curl_libevent_wheel_arm(self);
+}
+
+/************************************************************************
+ * response bodies
+ ************************************************************************/
+/*
+ * The body of a coalesced or cached request is kept by the library
+ * instead of being written through CURLOPT_WRITEFUNCTION, so that it can
+ * be shared by the requests and the cache.  The buffer is reference
+ * counted and given to on_done by curl_libevent_get_response().
+ */
+const struct curl_libevent_response *
+curl_libevent_get_response(struct curl_libevent *self, CURL *handle)
+{
+	struct curl_libevent_curl	*curl;
+	struct curl_libevent_job	*job = curl_libevent_job_current;
+
+	if (job != NULL && job->parent == self)
+		return ((job->handle == handle && job->body != NULL)?
+		    &job->body->resp : NULL);
+	curl = self->completing;
+	if (curl == NULL || curl->handle != handle || curl->body == NULL)
+		return (NULL);
+	return (&curl->body->resp);
+}
+
+/* Let the transfer write its body to a buffer of the library */
+void
+curl_libevent_buffer(struct curl_libevent_curl *curl)
+{
+	if (curl->body == NULL) {
+		curl->body = xcalloc(1, sizeof(*curl->body));
+		curl->body->refs = 1;
+		curl->body->resp.data = "";
+	}
+	curl->buffering = true;
+	curl->write_hooked = true;
+	curl_easy_setopt(curl->handle, CURLOPT_WRITEFUNCTION,
+	    curl_libevent_body_write);
+	curl_easy_setopt(curl->handle, CURLOPT_WRITEDATA, curl->body);
+}
+
+struct curl_libevent_body *
+curl_libevent_body_ref(struct curl_libevent_body *body)
+{
+	body->refs++;
+	return (body);
+}
+
+void
+curl_libevent_body_unref(struct curl_libevent_body *body)
+{
+	if (--body->refs > 0)
+		return;
+	xfree(body->buf);
+	xfree(body);
+}
+
+size_t
+curl_libevent_body_write(char *ptr, size_t size, size_t nmemb, void *ctx)
+{
+	struct curl_libevent_body	*body = ctx;
+	size_t				 len = size * nmemb, nsiz;
+	char				*nbuf;
+
+	if (body->resp.len + len > body->bufsiz) {
+		for (nsiz = MAXIMUM(body->bufsiz, 4096);
+		    nsiz < body->resp.len + len; nsiz *= 2)
+			;
+		nbuf = xcalloc(1, nsiz);
+		if (body->resp.len > 0)
+			memcpy(nbuf, body->buf, body->resp.len);
+		xfree(body->buf);
+		body->buf = nbuf;
+		body->bufsiz = nsiz;
+		body->resp.data = nbuf;
+	}
+	memcpy(body->buf + body->resp.len, ptr, len);
+	body->resp.len += len;
+
+	return (len);
+}
+
+/* The key of the URL of the handle and the given string */
+char *
+curl_libevent_url_key(CURL *handle, const char *str)
+{
+	char	*url, *key;
+	size_t	 urllen, len;
+
+	if (curl_easy_getinfo(handle, CURLINFO_EFFECTIVE_URL, &url) !=
+	    CURLE_OK || url == NULL || *url == '\0')
+		return (NULL);
+	urllen = strlen(url);
+	len = strlen(str);
+	key = xcalloc(1, urllen + 1 + len + 1);
+	memcpy(key, url, urllen);
+	key[urllen] = '\n';
+	memcpy(key + urllen + 1, str, len);
+
+	return (key);
+}
+
+/************************************************************************
+ * batched completions
+ ************************************************************************/
+/*
+ * With a batch handler, the requests performed without on_done are
+ * completed in an array of the records drained in a pass of
+ * curl_libevent_events(), or in the next loop iteration if completed
+ * elsewhere, e.g. cancelled or hit in the cache.  The handler takes the
+ * easy handles over; the responses are valid during the call.  The
+ * completions made in the handler go to the other array, so the array
+ * given is not touched until the handler returns.
+ */
+void
+curl_libevent_set_batch_done(struct curl_libevent *self,
+    void (*batch_done)(void *, const struct curl_libevent_completion *,
+    unsigned), void *arg)
+{
+	if (self->batch_done != NULL)
+		curl_libevent_batch_flush(self);
+	self->batch_done = batch_done;
+	self->batch_arg = arg;
+}
+
+void
+curl_libevent_batch_add(struct curl_libevent *self, void *ctx, CURL *handle,
+    CURLcode result, struct curl_libevent_body *body)
+{
+	struct curl_libevent_batch	*batch =
+					    &self->batches[self->batch_cur];
+	struct curl_libevent_completion	*rec, *nrecs;
+	struct curl_libevent_body	**nbodies;
+	unsigned			 nsiz;
+
+	if (batch->n >= batch->siz) {
+		nsiz = MAXIMUM(batch->siz * 2, 16);
+		nrecs = xcalloc(nsiz, sizeof(*nrecs));
+		nbodies = xcalloc(nsiz, sizeof(*nbodies));
+		if (batch->n > 0) {
+			memcpy(nrecs, batch->recs, batch->n * sizeof(*nrecs));
+			memcpy(nbodies, batch->bodies,
+			    batch->n * sizeof(*nbodies));
+		}
+		xfree(batch->recs);
+		xfree(batch->bodies);
+		batch->recs = nrecs;
+		batch->bodies = nbodies;
+		batch->siz = nsiz;
+	}
+	rec = &batch->recs[batch->n];
+	rec->ctx = ctx;
+	rec->easy = handle;
+	rec->result = result;
+	rec->response = (body != NULL)? &body->resp : NULL;
+	batch->bodies[batch->n++] = (body != NULL)?
+	    curl_libevent_body_ref(body) : NULL;
+	if (!self->in_events)
+		event_active(&self->ev_batch, EV_TIMEOUT, 1);
+}
+
+void
+curl_libevent_batch_flush(struct curl_libevent *self)
+{
+	struct curl_libevent_batch	*batch =
+					    &self->batches[self->batch_cur];
+	unsigned			 i;
+
+	if (batch->n == 0)
+		return;
+	self->batch_cur ^= 1;
+	self->batch_done(self->batch_arg, batch->recs, batch->n);
+	for (i = 0; i < batch->n; i++) {
+		if (batch->bodies[i] != NULL)
+			curl_libevent_body_unref(batch->bodies[i]);
+	}
+	batch->n = 0;
+}
+
+void
+curl_libevent_on_batch(int fd, short evmask, void *ctx)
+{
+	curl_libevent_batch_flush(ctx);
+}
+
+/************************************************************************
+ * completion executor
+ ************************************************************************/
+/*
+ * With an executor, the on_done callbacks run on a fixed pool of worker
+ * threads instead of the loop.  A job carries a copy of the message and a
+ * reference to the response; it is passed to the workers through a
+ * queue the loop pushes to without a lock and the workers pop under a
+ * mutex, with a byte on a socketpair to wake one of them up, and comes
+ * back to the loop through a lock-free queue after the callback returns, so the response and the pool of the easy handles are only
+ * touched by the loop.  nworkers 0 runs them on the loop again; the jobs
+ * queued are completed before the workers are stopped.
+ */
+int
+curl_libevent_set_executor(struct curl_libevent *self, int nworkers)
+{
+	struct curl_libevent_executor	*exec;
+
+	if (self->executor != NULL)
+		curl_libevent_executor_stop(self);
+	if (nworkers <= 0)
+		return (0);
+
+	exec = xcalloc(1, sizeof(*exec));
+	exec->parent = self;
+	curl_libevent_jobq_init(&exec->runq);
+	curl_libevent_jobq_init(&exec->doneq);
+	MUTEX_INIT(&exec->runq_mtx);
+	exec->runpairs[0] = exec->runpairs[1] = -1;
+	exec->donepairs[0] = exec->donepairs[1] = -1;
+	self->executor = exec;
+	if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, exec->runpairs) == -1)
+		goto fail;
+	if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, exec->donepairs)
+	    == -1) {
+		exec->donepairs[0] = exec->donepairs[1] = -1;
+		goto fail;
+	}
+	/* the workers block on runpairs[0] */
+	evutil_make_socket_nonblocking(exec->runpairs[1]);
+	evutil_make_socket_nonblocking(exec->donepairs[0]);
+	evutil_make_socket_nonblocking(exec->donepairs[1]);
+	event_set(&exec->ev_done, exec->donepairs[0], EV_READ | EV_PERSIST,
+	    curl_libevent_executor_on_done, exec);
+	if (self->eb != NULL)
+		event_base_set(self->eb, &exec->ev_done);
+	event_add(&exec->ev_done, NULL);
+
+	exec->workers = xcalloc(nworkers, sizeof(exec->workers[0]));
+	for (; exec->nworkers < nworkers; exec->nworkers++) {
+		if (THREAD_CREATE(&exec->workers[exec->nworkers],
+		    curl_libevent_executor_main, exec) != 0)
+			goto fail;
+	}
+
+	return (0);
+ fail:
+	warnx("%s: failed to start the workers", __func__);
+	curl_libevent_executor_stop(self);
+
+	return (-1);
+}
+
+void
+curl_libevent_executor_push(struct curl_libevent *self, void *ctx,
+    void (*on_done)(void *, CURLMsg *), CURLMsg *msg, CURL *handle,
+    struct curl_libevent_body *body)
+{
+	struct curl_libevent_executor	*exec = self->executor;
+	struct curl_libevent_job	*job;
+
+	job = xcalloc(1, sizeof(*job));
+	job->parent = self;
+	job->on_done = on_done;
+	job->ctx = ctx;
+	job->handle = handle;
+	job->msg = *msg;
+	if (body != NULL)
+		job->body = curl_libevent_body_ref(body);
+	curl_libevent_jobq_push(&exec->runq, job);
+	/*
+	 * If the socket is full, the workers have enough bytes to read and
+	 * each of them drains the queue after the wakeup.
+	 */
+	if (send(exec->runpairs[1], "", 1, 0) != -1 || SOCKET_WOULDBLOCK())
+		return;
+	/* no worker may wake up, run the jobs queued on the loop */
+	warnx("%s: send() failed", __func__);
+	for (;;) {
+		MUTEX_LOCK(&exec->runq_mtx);
+		job = curl_libevent_jobq_pop(&exec->runq);
+		MUTEX_UNLOCK(&exec->runq_mtx);
+		if (job == NULL)
+			break;
+		curl_libevent_job_run(job);
+		curl_libevent_job_free(self, job);
+	}
+}
+
+/* Stop the workers after the jobs queued and take the jobs back */
+void
+curl_libevent_executor_stop(struct curl_libevent *self)
+{
+	struct curl_libevent_executor	*exec = self->executor;
+	struct curl_libevent_job	*job;
+	int				 i;
+
+	/* EOF wakes all of them up */
+	if (exec->runpairs[1] != -1)
+		evutil_closesocket(exec->runpairs[1]);
+	for (i = 0; i < exec->nworkers; i++)
+		THREAD_JOIN(exec->workers[i]);
+	if (exec->runpairs[0] != -1)
+		evutil_closesocket(exec->runpairs[0]);
+	while ((job = curl_libevent_jobq_pop(&exec->doneq)) != NULL)
+		curl_libevent_job_free(self, job);
+	if (exec->donepairs[0] != -1) {
+		event_del(&exec->ev_done);
+		evutil_closesocket(exec->donepairs[0]);
+		evutil_closesocket(exec->donepairs[1]);
+	}
+	MUTEX_DESTROY(&exec->runq_mtx);
+	xfree(exec->workers);
+	xfree(exec);
+	self->executor = NULL;
+}
+
+CURL_LIBEVENT_THREAD_FUNC
+curl_libevent_executor_main(void *ctx)
+{
+	struct curl_libevent_executor	*exec = ctx;
+	struct curl_libevent_job	*job;
+	char				 c;
+	int				 n;
+
+	do {
+		n = recv(exec->runpairs[0], &c, 1, 0);
+		for (;;) {
+			MUTEX_LOCK(&exec->runq_mtx);
+			job = curl_libevent_jobq_pop(&exec->runq);
+			MUTEX_UNLOCK(&exec->runq_mtx);
+			if (job == NULL)
+				break;
+			curl_libevent_job_run(job);
+			curl_libevent_jobq_push(&exec->doneq, job);
+			if (ATOMIC_XCHG(&exec->done_wakeup, 1) == 0)
+				send(exec->donepairs[1], "", 1, 0);
+		}
+	} while (n != 0);
+
+	return (0);
+}
+
+void
+curl_libevent_executor_on_done(evutil_socket_t fd, short evmask, void *ctx)
+{
+	struct curl_libevent_executor	*exec = ctx;
+	struct curl_libevent_job	*job;
+	char				 buf[128];
+
+	while (recv(fd, buf, sizeof(buf), 0) > 0)
+		;
+	/* workers after this point wake us up again */
+	ATOMIC_XCHG(&exec->done_wakeup, 0);
+	while ((job = curl_libevent_jobq_pop(&exec->doneq)) != NULL)
+		curl_libevent_job_free(exec->parent, job);
+}
+
+void
+curl_libevent_job_run(struct curl_libevent_job *job)
+{
+	curl_libevent_job_current = job;
+	job->on_done(job->ctx, &job->msg);
+	curl_libevent_job_current = NULL;
+}
+
+void
+curl_libevent_job_free(struct curl_libevent *self,
+    struct curl_libevent_job *job)
+{
+	if (job->put != NULL)
+		curl_libevent_easy_put(self, job->put);
+	if (job->body != NULL)
+		curl_libevent_body_unref(job->body);
+	xfree(job);
+}
+
+/* The same MPSC queue as the submissions, with the stub embedded */
+void
+curl_libevent_jobq_init(struct curl_libevent_jobq *q)
+{
+	q->stub.next = NULL;
+	q->head = q->tail = &q->stub;
+}
+
+void
+curl_libevent_jobq_push(struct curl_libevent_jobq *q,
+    struct curl_libevent_job *job)
+{
+	struct curl_libevent_job	*prev;
+
+	ATOMIC_STORE_PTR(&job->next, NULL);
+	prev = ATOMIC_XCHG_PTR(&q->head, job);
+	ATOMIC_STORE_PTR(&prev->next, job);
+}
+
+struct curl_libevent_job *
+curl_libevent_jobq_pop(struct curl_libevent_jobq *q)
+{
+	struct curl_libevent_job	*tail = q->tail, *next;
+
+	next = ATOMIC_LOAD_PTR(&tail->next);
+	if (tail == &q->stub) {
+		if (next == NULL)
+			return (NULL);
+		q->tail = tail = next;
+		next = ATOMIC_LOAD_PTR(&tail->next);
+	}
+	if (next != NULL) {
+		q->tail = next;
+		return (tail);
+	}
+	if (tail != ATOMIC_LOAD_PTR(&q->head))
+		/* a producer is in the middle of the push; it wakes us up */
+		return (NULL);
+	curl_libevent_jobq_push(q, &q->stub);
+	if ((next = ATOMIC_LOAD_PTR(&tail->next)) != NULL) {
+		q->tail = next;
+		return (tail);
+	}
+
+	return (NULL);
+}
+
+/************************************************************************
+ * coalescing
+ ************************************************************************/
+/*
+ * The requests having coalesce_key in the attribute are keyed by the URL
+ * and coalesce_key.  While a transfer of a key is in flight, the requests
+ * of the same key don't start but wait for it, then all of them are
+ * completed with the result and the body of the one.  If the leader is
+ * cancelled or expired, the first waiter takes over.
+ */
+struct curl_libevent_flight *
+curl_libevent_flight_find(struct curl_libevent *self, const char *key)
+{
+	struct curl_libevent_flight	*flight;
+
+	LIST_FOREACH(flight, &self->flights[curl_libevent_strhash(key) %
+	    CURL_LIBEVENT_FLIGHT_HASHSIZ], hash) {
+		if (strcmp(flight->key, key) == 0)
+			return (flight);
+	}
+
+	return (NULL);
+}
+
+/* Start a flight led by the transfer.  The key is taken over */
+void
+curl_libevent_flight_create(struct curl_libevent *self,
+    struct curl_libevent_curl *curl, char *key)
+{
+	struct curl_libevent_flight	*flight;
+
+	flight = xcalloc(1, sizeof(*flight));
+	flight->key = key;
+	flight->refs = 1;
+	TAILQ_INIT(&flight->waiters);
+	LIST_INSERT_HEAD(&self->flights[curl_libevent_strhash(key) %
+	    CURL_LIBEVENT_FLIGHT_HASHSIZ], flight, hash);
+	flight->leader = curl;
+	curl->flight = flight;
+	curl_libevent_buffer(curl);
+}
+
+/* The transfer is aborted, hand the flight over to the next if leading */
+void
+curl_libevent_flight_leave(struct curl_libevent *self,
+    struct curl_libevent_curl *curl)
+{
+	struct curl_libevent_flight	*flight = curl->flight;
+	struct curl_libevent_curl	*next;
+
+	curl->flight = NULL;
+	if (curl->state == CURL_LIBEVENT_CURL_COALESCED) {
+		TAILQ_REMOVE(&flight->waiters, curl, next);
+		curl->state = CURL_LIBEVENT_CURL_INIT;
+	} else if (flight->leader == curl) {
+		if ((next = TAILQ_FIRST(&flight->waiters)) != NULL) {
+			TAILQ_REMOVE(&flight->waiters, next, next);
+			next->state = CURL_LIBEVENT_CURL_INIT;
+			flight->leader = next;
+			curl_libevent_buffer(next);
+			curl_libevent_admit(self, next);
+		} else {
+			LIST_REMOVE(flight, hash);
+			flight->leader = NULL;
+		}
+	}
+	curl_libevent_flight_unref(flight);
+}
+
+void
+curl_libevent_flight_done(struct curl_libevent *self,
+    struct curl_libevent_curl *leader, CURLMsg *msg)
+{
+	struct curl_libevent_flight	*flight = leader->flight;
+	struct curl_libevent_body	*body;
+	struct curl_libevent_curl	*curl;
+	CURLMsg				 wmsg;
+
+	/* the requests from here start a new flight */
+	LIST_REMOVE(flight, hash);
+	flight->leader = NULL;
+	flight->refs++;		/* on_done may cancel the waiters */
+	/* the leader's handle may be cleaned up by on_done */
+	body = curl_libevent_body_ref(leader->body);
+	wmsg = *msg;
+	curl_libevent_finish(self, leader, msg);
+	while ((curl = TAILQ_FIRST(&flight->waiters)) != NULL) {
+		TAILQ_REMOVE(&flight->waiters, curl, next);
+		curl->state = CURL_LIBEVENT_CURL_INIT;
+		curl->body = curl_libevent_body_ref(body);
+		wmsg.easy_handle = curl->handle;
+		curl_libevent_finish(self, curl, &wmsg);
+	}
+	curl_libevent_body_unref(body);
+	curl_libevent_flight_unref(flight);
+}
+
+void
+curl_libevent_flight_unref(struct curl_libevent_flight *flight)
+{
+	if (--flight->refs > 0)
+		return;
+	xfree(flight->key);
+	xfree(flight);
+}
+
+/************************************************************************
+ * cache
+ ************************************************************************/
+/*
+ * An LRU cache of the responses bounded by the bytes it holds.  The
+ * requests having cache_key in the attribute are looked up by the URL and
+ * cache_key.  A fresh entry completes the request in the next loop
+ * iteration without a transfer.  A stale entry having a validator is
+ * revalidated with If-None-Match or If-Modified-Since added to the
+ * headers of the attribute, and is used again if the origin answers 304.
+ * The freshness is max-age of Cache-Control less Age.
+ */
+void
+curl_libevent_set_cache(struct curl_libevent *self, size_t max)
+{
+	self->cache_max = max;
+	curl_libevent_cache_trim(self);
+}
+
+void
+curl_libevent_get_cache_stats(struct curl_libevent *self,
+    struct curl_libevent_cache_stats *stats)
+{
+	*stats = self->cache_stats;
+	stats->entries = self->ncache;
+	stats->bytes = self->cache_bytes;
+}
+
+struct curl_libevent_cache_entry *
+curl_libevent_cache_find(struct curl_libevent *self, const char *key)
+{
+	struct curl_libevent_cache_entry	*entry;
+
+	LIST_FOREACH(entry, &self->cache[curl_libevent_strhash(key) %
+	    CURL_LIBEVENT_CACHE_HASHSIZ], hash) {
+		if (strcmp(entry->key, key) == 0)
+			return (entry);
+	}
+
+	return (NULL);
+}
+
+/* Complete the request with the entry in the next loop iteration */
+void
+curl_libevent_cache_hit(struct curl_libevent *self,
+    struct curl_libevent_curl *curl, struct curl_libevent_cache_entry *entry)
+{
+	TAILQ_REMOVE(&self->cache_lru, entry, lru);
+	TAILQ_INSERT_HEAD(&self->cache_lru, entry, lru);
+	curl->body = curl_libevent_body_ref(entry->body);
+	curl->state = CURL_LIBEVENT_CURL_CACHED;
+	TAILQ_INSERT_TAIL(&self->hits, curl, next);
+	if (self->nhits++ == 0)
+		event_active(&self->ev_hits, EV_TIMEOUT, 1);
+	self->cache_stats.hits++;
+}
+
+void
+curl_libevent_on_hits(int fd, short evmask, void *ctx)
+{
+	struct curl_libevent		*self = ctx;
+	struct curl_libevent_curl	*curl;
+	CURLMsg				 msg;
+	unsigned			 n;
+
+	/* the hits made by on_done are for the next iteration */
+	for (n = self->nhits; n > 0; n--) {
+		if ((curl = TAILQ_FIRST(&self->hits)) == NULL)
+			break;
+		TAILQ_REMOVE(&self->hits, curl, next);
+		self->nhits--;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg = CURLMSG_DONE;
+		msg.easy_handle = curl->handle;
+		msg.data.result = (curl->state == CURL_LIBEVENT_CURL_TRIPPED)?
+		    CURL_LIBEVENT_E_CIRCUIT_OPEN : CURLE_OK;
+		curl->state = CURL_LIBEVENT_CURL_INIT;
+		curl_libevent_finish(self, curl, &msg);
+	}
+	if (self->nhits > 0)
+		event_active(&self->ev_hits, EV_TIMEOUT, 1);
+}
+
+/*
+ * Let the transfer fill the entry of the key, which is taken over.  The
+ * stale entry is revalidated if it has a validator.
+ */
+void
+curl_libevent_cache_request(struct curl_libevent *self,
+    struct curl_libevent_curl *curl, char *key,
+    struct curl_libevent_cache_entry *entry)
+{
+	struct curl_slist	*sl, *list = NULL;
+
+	curl->cache_key = key;
+	curl_libevent_buffer(curl);
+	if (entry == NULL ||
+	    (entry->etag == NULL && entry->last_modified == NULL))
+		return;
+	for (sl = curl->headers; sl != NULL; sl = sl->next)
+		list = curl_slist_append(list, sl->data);
+	if (entry->etag != NULL)
+		list = curl_libevent_slist_printf(list, "If-None-Match",
+		    entry->etag);
+	if (entry->last_modified != NULL)
+		list = curl_libevent_slist_printf(list, "If-Modified-Since",
+		    entry->last_modified);
+	curl->cond_headers = list;
+	curl_easy_setopt(curl->handle, CURLOPT_HTTPHEADER, list);
+	curl->cached = curl_libevent_body_ref(entry->body);
+	self->cache_stats.revalidations++;
+}
+
+struct curl_slist *
+curl_libevent_slist_printf(struct curl_slist *list, const char *name,
+    const char *value)
+{
+	struct curl_slist	*ret;
+	size_t			 len;
+	char			*buf;
+
+	len = strlen(name) + 2 + strlen(value) + 1;
+	buf = xcalloc(1, len);
+	snprintf(buf, len, "%s: %s", name, value);
+	ret = curl_slist_append(list, buf);
+	xfree(buf);
+
+	return (ret);
+}
+
+/* The transfer for the cache is done */
+void
+curl_libevent_cache_done(struct curl_libevent *self,
+    struct curl_libevent_curl *curl, CURLMsg *msg)
+{
+	struct curl_libevent_cache_entry	*entry;
+	char					*key = curl->cache_key;
+	long					 code = 0, maxage;
+
+	curl->cache_key = NULL;
+	if (curl->cond_headers != NULL) {
+		curl_easy_setopt(curl->handle, CURLOPT_HTTPHEADER,
+		    curl->headers);
+		curl_slist_free_all(curl->cond_headers);
+		curl->cond_headers = NULL;
+	}
+	if (msg->data.result == CURLE_OK)
+		curl_easy_getinfo(curl->handle, CURLINFO_RESPONSE_CODE, &code);
+	if (code == 304 && curl->cached != NULL) {
+		/* not modified, serve the body revalidated */
+		curl_libevent_body_unref(curl->body);
+		curl->body = curl->cached;
+		curl->cached = NULL;
+		self->cache_stats.not_modified++;
+		if ((entry = curl_libevent_cache_find(self, key)) != NULL &&
+		    entry->body == curl->body) {
+			if (curl_libevent_cache_freshness(curl->handle, &maxage,
+			    NULL) == 0)
+				entry->maxage = maxage;
+			entry->expires = curl_libevent_wheel_ticks(self) +
+			    entry->maxage * 1000;
+		}
+	} else if (code == 200) {
+		curl_libevent_cache_store(self, curl, key);
+		key = NULL;
+	}
+	if (curl->cached != NULL) {
+		curl_libevent_body_unref(curl->cached);
+		curl->cached = NULL;
+	}
+	xfree(key);
+}
+
+/* Store the response of the transfer for the key, which is taken over */
+void
+curl_libevent_cache_store(struct curl_libevent *self,
+    struct curl_libevent_curl *curl, char *key)
+{
+	struct curl_libevent_cache_entry	*entry;
+	struct curl_header			*h;
+	char					*etag = NULL, *lm = NULL;
+	long					 maxage;
+	bool					 nostore;
+	size_t					 size;
+
+	if (curl_libevent_cache_freshness(curl->handle, &maxage, &nostore)
+	    != 0)
+		maxage = 0;	/* no heuristics, revalidate each time */
+	if (curl_easy_header(curl->handle, "ETag", 0, CURLH_HEADER, -1, &h)
+	    == CURLHE_OK)
+		etag = h->value;
+	if (curl_easy_header(curl->handle, "Last-Modified", 0, CURLH_HEADER,
+	    -1, &h) == CURLHE_OK)
+		lm = h->value;
+	size = sizeof(*entry) + strlen(key) + curl->body->resp.len;
+	if (nostore || (maxage <= 0 && etag == NULL && lm == NULL) ||
+	    size > self->cache_max) {
+		xfree(key);
+		return;
+	}
+
+	if ((entry = curl_libevent_cache_find(self, key)) != NULL)
+		curl_libevent_cache_remove(self, entry);
+	entry = xcalloc(1, sizeof(*entry));
+	entry->key = key;
+	entry->body = curl_libevent_body_ref(curl->body);
+	entry->size = size;
+	entry->maxage = maxage;
+	entry->expires = curl_libevent_wheel_ticks(self) + maxage * 1000;
+	if (etag != NULL)
+		entry->etag = curl_libevent_strdup(etag);
+	if (lm != NULL)
+		entry->last_modified = curl_libevent_strdup(lm);
+	LIST_INSERT_HEAD(&self->cache[curl_libevent_strhash(key) %
+	    CURL_LIBEVENT_CACHE_HASHSIZ], entry, hash);
+	TAILQ_INSERT_HEAD(&self->cache_lru, entry, lru);
+	self->ncache++;
+	self->cache_bytes += size;
+	self->cache_stats.stores++;
+	curl_libevent_cache_trim(self);
+}
+
+/*
+ * Get the seconds the response is fresh from Cache-Control and Age.
+ * Returns -1 if the response has no max-age.
+ */
+int
+curl_libevent_cache_freshness(CURL *handle, long *maxage, bool *nostore)
+{
+	struct curl_header	*h;
+	const char		*p;
+	size_t			 i, n = 1;
+	int			 ret = -1;
+
+	if (nostore != NULL)
+		*nostore = false;
+	for (i = 0; i < n; i++) {
+		if (curl_easy_header(handle, "Cache-Control", i, CURLH_HEADER,
+		    -1, &h) != CURLHE_OK)
+			break;
+		n = h->amount;
+		for (p = h->value; *p != '\0'; p += strcspn(p, ",")) {
+			p += strspn(p, ", \t");
+			if (curl_strnequal(p, "max-age=", 8)) {
+				*maxage = strtol(p + 8, NULL, 10);
+				ret = 0;
+			} else if (curl_strnequal(p, "no-cache", 8)) {
+				*maxage = 0;
+				ret = 0;
+			} else if (curl_strnequal(p, "no-store", 8) &&
+			    nostore != NULL)
+				*nostore = true;
+		}
+	}
+	if (ret == 0 && curl_easy_header(handle, "Age", 0, CURLH_HEADER, -1,
+	    &h) == CURLHE_OK)
+		*maxage -= strtol(h->value, NULL, 10);
+	if (ret == 0 && *maxage < 0)
+		*maxage = 0;
+
+	return (ret);
+}
+
+void
+curl_libevent_cache_remove(struct curl_libevent *self,
+    struct curl_libevent_cache_entry *entry)
+{
+	LIST_REMOVE(entry, hash);
+	TAILQ_REMOVE(&self->cache_lru, entry, lru);
+	self->ncache--;
+	self->cache_bytes -= entry->size;
+	curl_libevent_body_unref(entry->body);
+	xfree(entry->key);
+	xfree(entry->etag);
+	xfree(entry->last_modified);
+	xfree(entry);
+}
+
+/* Evict the least recently used entries over the limit */
+void
+curl_libevent_cache_trim(struct curl_libevent *self)
+{
+	struct curl_libevent_cache_entry	*entry;
+
+	while (self->cache_bytes > self->cache_max &&
+	    (entry = TAILQ_LAST(&self->cache_lru,
+	    curl_libevent_cache_lru)) != NULL) {
+		curl_libevent_cache_remove(self, entry);
+		self->cache_stats.evictions++;
+	}
+}
+
+/************************************************************************
+ * hosts
+ ************************************************************************/
+/*
+ * The latencies of the transfers to a host are kept in a histogram of
+ * 4 buckets per power of 2 microseconds, which is halved when it has
+ * enough samples so that it follows the recent ones.  A host no record
+ * refers is kept for the next transfers, up to CURL_LIBEVENT_HOST_IDLE_MAX
+ * of them by the last use; an open breaker is kept until it half-opens.
+ */
+struct curl_libevent_host *
+curl_libevent_host_get(struct curl_libevent *self, const char *name)
+{
+	struct curl_libevent_host	*host;
+	unsigned			 idx;
+
+	idx = curl_libevent_strhash(name) % CURL_LIBEVENT_HOST_HASHSIZ;
+	LIST_FOREACH(host, &self->hosts[idx], hash) {
+		if (strcmp(host->name, name) == 0) {
+			curl_libevent_host_ref(self, host);
+			return (host);
+		}
+	}
+	host = xcalloc(1, sizeof(*host));
+	host->name = curl_libevent_strdup(name);
+	host->limiter = self->host_limiter;
+	host->refs = 1;
+	TAILQ_INIT(&host->throttled);
+	LIST_INSERT_HEAD(&self->hosts[idx], host, hash);
+
+	return (host);
+}
+
+void
+curl_libevent_host_ref(struct curl_libevent *self,
+    struct curl_libevent_host *host)
+{
+	if (host->refs++ == 0 && host->is_idle) {
+		TAILQ_REMOVE(&self->hosts_idle, host, idle);
+		host->is_idle = false;
+		self->nhosts_idle--;
+	}
+}
+
+void
+curl_libevent_host_unref(struct curl_libevent *self,
+    struct curl_libevent_host *host)
+{
+	unsigned	 n;
+
+	if (--host->refs > 0)
+		return;
+	TAILQ_INSERT_TAIL(&self->hosts_idle, host, idle);
+	host->is_idle = true;
+	self->nhosts_idle++;
+	for (n = self->nhosts_idle; n > 0 &&
+	    self->nhosts_idle > CURL_LIBEVENT_HOST_IDLE_MAX; n--) {
+		host = TAILQ_FIRST(&self->hosts_idle);
+		TAILQ_REMOVE(&self->hosts_idle, host, idle);
+		if (host->breaker == CURL_LIBEVENT_BREAKER_OPEN &&
+		    curl_libevent_wheel_ticks(self) - host->opened_at <
+		    self->breaker.open_ms) {
+			TAILQ_INSERT_TAIL(&self->hosts_idle, host, idle);
+			continue;
+		}
+		self->nhosts_idle--;
+		if (host->queued)
+			TAILQ_REMOVE(&self->hostq, host, hostq);
+		LIST_REMOVE(host, hash);
+		xfree(host->name);
+		xfree(host);
+	}
+}
+
+void
+curl_libevent_host_account(struct curl_libevent_host *host, CURL *handle)
+{
+	curl_off_t	 usec = 0;
+	int		 i, msb;
+
+	if (curl_easy_getinfo(handle, CURLINFO_TOTAL_TIME_T, &usec) !=
+	    CURLE_OK || usec < 0)
+		return;
+	if (usec < 4)
+		i = (int)usec;
+	else {
+		for (msb = 2; ((uint64_t)usec >> (msb + 1)) != 0; msb++)
+			;
+		i = msb * 4 + (int)((usec >> (msb - 2)) & 3);
+	}
+	host->latency[MINIMUM(i, CURL_LIBEVENT_LAT_BUCKETS - 1)]++;
+	if (++host->nsamples >= CURL_LIBEVENT_LAT_DECAY) {
+		host->nsamples = 0;
+		for (i = 0; i < CURL_LIBEVENT_LAT_BUCKETS; i++) {
+			host->latency[i] /= 2;
+			host->nsamples += host->latency[i];
+		}
+	}
+}
+
+/* The latency at the percentile in microseconds, 0 if too few samples */
+uint64_t
+curl_libevent_host_percentile(struct curl_libevent_host *host,
+    unsigned percent)
+{
+	unsigned	 n = 0, rank;
+	int		 i;
+
+	if (host->nsamples < CURL_LIBEVENT_LAT_MINSAMPLES)
+		return (0);
+	rank = (host->nsamples * percent + 99) / 100;
+	for (i = 0; i < CURL_LIBEVENT_LAT_BUCKETS; i++) {
+		if ((n += host->latency[i]) >= rank)
+			break;
+	}
+	/* the upper bound of the bucket */
+	if (i < 4)
+		return (i + 1);
+	return ((uint64_t)(4 + (i & 3) + 1) << (i / 4 - 2));
+}
+
+/************************************************************************
+ * adaptive concurrency limit
+ ************************************************************************/
+/*
+ * The limit of the active transfers, of the instance or of each host,
+ * follows the latency of the completed ones by CURLINFO_TOTAL_TIME_T.
+ * AIMD adds 1 for each round of the limit and backs off by 10% when the
+ * latency gets twice of the minimum or a transfer is dropped, timed out
+ * or answered 429 or 503.  The gradient compares the recent latency to
+ * the minimum and shrinks the limit as the queue of the upstream grows,
+ * with the room of the square root of the limit to probe.  The limit
+ * doesn't grow while less than the half of it is used.
+ */
+void
+curl_libevent_set_adaptive_limit(struct curl_libevent *self, int algo,
+    unsigned min, unsigned max)
+{
+	curl_libevent_limiter_init(&self->limiter, algo, min, max);
+	self->max_active = (algo == CURL_LIBEVENT_LIMIT_NONE)? 0 :
+	    (unsigned)self->limiter.limit;
+	curl_libevent_promote(self);
+}
+
+void
+curl_libevent_set_host_adaptive_limit(struct curl_libevent *self, int algo,
+    unsigned min, unsigned max)
+{
+	struct curl_libevent_host	*host;
+	int				 i;
+
+	curl_libevent_limiter_init(&self->host_limiter, algo, min, max);
+	for (i = 0; i < CURL_LIBEVENT_HOST_HASHSIZ; i++) {
+		LIST_FOREACH(host, &self->hosts[i], hash) {
+			host->limiter = self->host_limiter;
+			if (!TAILQ_EMPTY(&host->throttled) && !host->queued) {
+				TAILQ_INSERT_TAIL(&self->hostq, host, hostq);
+				host->queued = true;
+			}
+		}
+	}
+	curl_libevent_promote(self);
+}
+
+/* The current limit of the host or of the instance if NULL, 0 if none */
+unsigned
+curl_libevent_get_limit(struct curl_libevent *self, const char *name)
+{
+	struct curl_libevent_host	*host;
+	unsigned			 idx;
+
+	if (name == NULL)
+		return (self->max_active);
+	idx = curl_libevent_strhash(name) % CURL_LIBEVENT_HOST_HASHSIZ;
+	LIST_FOREACH(host, &self->hosts[idx], hash) {
+		if (strcmp(host->name, name) == 0)
+			break;
+	}
+	if (host == NULL || host->limiter.algo == CURL_LIBEVENT_LIMIT_NONE)
+		return (0);
+
+	return ((unsigned)host->limiter.limit);
+}
+
+void
+curl_libevent_limiter_init(struct curl_libevent_limiter *limiter, int algo,
+    unsigned min, unsigned max)
+{
+	memset(limiter, 0, sizeof(*limiter));
+	limiter->algo = algo;
+	limiter->min = MAXIMUM(min, 1);
+	limiter->max = (max > 0)? MAXIMUM(max, limiter->min) :
+	    MAXIMUM(CURL_LIBEVENT_LIMIT_MAX, limiter->min);
+	limiter->limit = MINIMUM(MAXIMUM(CURL_LIBEVENT_LIMIT_INITIAL,
+	    limiter->min), limiter->max);
+}
+
+void
+curl_libevent_limiter_sample(struct curl_libevent_limiter *limiter,
+    double rtt, unsigned inflight, bool dropped)
+{
+	double		 gradient, limit;
+
+	if (limiter->rtt_min == 0)
+		limiter->rtt_short = limiter->rtt_min = rtt;
+	limiter->rtt_short += (rtt - limiter->rtt_short) /
+	    CURL_LIBEVENT_LIMIT_SHORTWIN;
+	/* the minimum creeps up not to stick to an old one */
+	if (rtt < limiter->rtt_min)
+		limiter->rtt_min = rtt;
+	else
+		limiter->rtt_min += (rtt - limiter->rtt_min) /
+		    CURL_LIBEVENT_LIMIT_MINWIN;
+	limiter->since_decrease++;
+
+	if (dropped || (limiter->algo == CURL_LIBEVENT_LIMIT_AIMD &&
+	    rtt > limiter->rtt_min * CURL_LIBEVENT_LIMIT_AIMD_RATIO)) {
+		/* once a round */
+		if (limiter->since_decrease >= limiter->limit) {
+			limiter->limit *= CURL_LIBEVENT_LIMIT_BACKOFF;
+			limiter->since_decrease = 0;
+		}
+	} else if (limiter->algo == CURL_LIBEVENT_LIMIT_AIMD) {
+		if (inflight * 2 >= limiter->limit)
+			limiter->limit += 1.0 / limiter->limit;
+	} else if (limiter->algo == CURL_LIBEVENT_LIMIT_GRADIENT) {
+		if (inflight * 2 >= limiter->limit) {
+			gradient = CURL_LIBEVENT_LIMIT_TOLERANCE *
+			    limiter->rtt_min / limiter->rtt_short;
+			gradient = MAXIMUM(0.5, MINIMUM(1.0, gradient));
+			limit = limiter->limit * gradient +
+			    curl_libevent_isqrt((unsigned)limiter->limit);
+			limiter->limit += (limit - limiter->limit) *
+			    CURL_LIBEVENT_LIMIT_SMOOTHING;
+		}
+	}
+	limiter->limit = MAXIMUM(limiter->min,
+	    MINIMUM(limiter->max, limiter->limit));
+}
+
+/* Feed the latency of the transfer done to the limiters */
+void
+curl_libevent_limit_account(struct curl_libevent *self,
+    struct curl_libevent_curl *curl, CURLMsg *msg)
+{
+	struct curl_libevent_host	*host = curl->host;
+	curl_off_t			 usec = 0;
+	long				 code = 0;
+	bool				 dropped;
+
+	if (self->limiter.algo == CURL_LIBEVENT_LIMIT_NONE && (host == NULL ||
+	    host->limiter.algo == CURL_LIBEVENT_LIMIT_NONE))
+		return;
+	switch (msg->data.result) {
+	case CURLE_OK:
+	case CURLE_HTTP_RETURNED_ERROR:
+		curl_easy_getinfo(curl->handle, CURLINFO_RESPONSE_CODE, &code);
+		dropped = (code == 429 || code == 503);
+		break;
+	case CURLE_OPERATION_TIMEDOUT:
+		dropped = true;
+		break;
+	default:
+		return;	/* tells nothing of the load */
+	}
+	if (curl_easy_getinfo(curl->handle, CURLINFO_TOTAL_TIME_T, &usec) !=
+	    CURLE_OK || usec <= 0)
+		return;
+
+	if (self->limiter.algo != CURL_LIBEVENT_LIMIT_NONE) {
+		curl_libevent_limiter_sample(&self->limiter, (double)usec,
+		    self->nactive, dropped);
+		self->max_active = (unsigned)self->limiter.limit;
+	}
+	if (host != NULL && host->limiter.algo != CURL_LIBEVENT_LIMIT_NONE)
+		curl_libevent_limiter_sample(&host->limiter, (double)usec,
+		    host->nactive, dropped);
+}
+
+/* Give the room back to the host, the throttled is started by promote */
+void
+curl_libevent_host_release(struct curl_libevent *self,
+    struct curl_libevent_curl *curl)
+{
+	struct curl_libevent_host	*host = curl->host;
+
+	if (!curl->host_slot)
+		return;
+	curl->host_slot = false;
+	host->nactive--;
+	if (!TAILQ_EMPTY(&host->throttled) && !host->queued) {
+		TAILQ_INSERT_TAIL(&self->hostq, host, hostq);
+		host->queued = true;
+	}
+}
+
+bool
+curl_libevent_track_hosts(struct curl_libevent *self)
+{
+	return (self->breaker.min_calls > 0 ||
+	    self->host_limiter.algo != CURL_LIBEVENT_LIMIT_NONE);
+}
+
+unsigned
+curl_libevent_isqrt(unsigned n)
+{
+	unsigned	 r = 1;
+
+	while ((r + 1) * (r + 1) <= n)
+		r++;
+
+	return (r);
+}
+
+/************************************************************************
+ * circuit breaker
+ ************************************************************************/
+/*
+ * The breaker of a host opens when the rate of the failures, the errors
+ * or HTTP 5xx, or of the calls slower than slow_ms reaches the threshold
+ * in the window of the recent calls.  The requests to the open host fail
+ * with CURL_LIBEVENT_E_CIRCUIT_OPEN in the next loop iteration without
+ * taking a slot.  After open_ms, the breaker is half-open and lets the
+ * probes through; it closes when they all succeed and opens again on a
+ * failure of any.
+ */
+void
+curl_libevent_set_breaker(struct curl_libevent *self,
+    const struct curl_libevent_breaker *breaker)
+{
+	if (breaker == NULL)
+		memset(&self->breaker, 0, sizeof(self->breaker));
+	else
+		self->breaker = *breaker;
+}
+
+int
+curl_libevent_get_breaker_stats(struct curl_libevent *self,
+    const char *name, struct curl_libevent_breaker_stats *stats)
+{
+	struct curl_libevent_host	*host;
+	unsigned			 idx;
+
+	idx = curl_libevent_strhash(name) % CURL_LIBEVENT_HOST_HASHSIZ;
+	LIST_FOREACH(host, &self->hosts[idx], hash) {
+		if (strcmp(host->name, name) == 0)
+			break;
+	}
+	if (host == NULL)
+		return (-1);
+	memset(stats, 0, sizeof(*stats));
+	stats->state = host->breaker;
+	if (host->breaker == CURL_LIBEVENT_BREAKER_OPEN &&
+	    curl_libevent_wheel_ticks(self) - host->opened_at >=
+	    self->breaker.open_ms)
+		stats->state = CURL_LIBEVENT_BREAKER_HALF_OPEN;
+	stats->calls = host->calls;
+	stats->failures = host->failures;
+	stats->slow = host->slow;
+	stats->opened = host->opened;
+	stats->rejected = host->rejected;
+
+	return (0);
+}
+
+/* Whether the transfer may go to the host, as a probe if half-open */
+bool
+curl_libevent_breaker_allow(struct curl_libevent *self,
+    struct curl_libevent_curl *curl)
+{
+	struct curl_libevent_host	*host = curl->host;
+
+	if (self->breaker.min_calls == 0 || host == NULL)
+		return (true);
+	switch (host->breaker) {
+	case CURL_LIBEVENT_BREAKER_OPEN:
+		if (curl_libevent_wheel_ticks(self) - host->opened_at <
+		    self->breaker.open_ms)
+			return (false);
+		host->breaker = CURL_LIBEVENT_BREAKER_HALF_OPEN;
+		host->probes = 0;
+		host->probes_ok = 0;
+		/* FALLTHROUGH */
+	case CURL_LIBEVENT_BREAKER_HALF_OPEN:
+		if (host->probes >= MAXIMUM(self->breaker.probes, 1))
+			return (false);
+		host->probes++;
+		curl->probe = true;
+		break;
+	}
+
+	return (true);
+}
+
+/* Fail the transfer in the next loop iteration */
+void
+curl_libevent_breaker_trip(struct curl_libevent *self,
+    struct curl_libevent_curl *curl)
+{
+	curl->host->rejected++;
+	self->stats.circuit_open++;
+	curl->state = CURL_LIBEVENT_CURL_TRIPPED;
+	TAILQ_INSERT_TAIL(&self->hits, curl, next);
+	if (self->nhits++ == 0)
+		event_active(&self->ev_hits, EV_TIMEOUT, 1);
+}
+
+void
+curl_libevent_breaker_account(struct curl_libevent *self,
+    struct curl_libevent_curl *curl, CURLMsg *msg)
+{
+	struct curl_libevent_breaker	*conf = &self->breaker;
+	struct curl_libevent_host	*host = curl->host;
+	curl_off_t			 usec = 0;
+	long				 code = 0;
+	bool				 failed, slow = false;
+
+	if (conf->min_calls == 0)
+		return;
+	switch (msg->data.result) {
+	case CURLE_OK:
+	case CURLE_HTTP_RETURNED_ERROR:
+		curl_easy_getinfo(curl->handle, CURLINFO_RESPONSE_CODE, &code);
+		failed = (code >= 500);
+		break;
+	case CURLE_ABORTED_BY_CALLBACK:
+		return;
+	default:
+		failed = true;
+		break;
+	}
+	if (conf->slow_ms > 0 && curl_easy_getinfo(curl->handle,
+	    CURLINFO_TOTAL_TIME_T, &usec) == CURLE_OK)
+		slow = (usec >= (curl_off_t)conf->slow_ms * 1000);
+
+	if (curl->probe) {
+		curl->probe = false;
+		if (host->breaker != CURL_LIBEVENT_BREAKER_HALF_OPEN)
+			return;
+		if (failed || slow)
+			curl_libevent_breaker_open(self, host);
+		else if (++host->probes_ok >= MAXIMUM(conf->probes, 1)) {
+			host->breaker = CURL_LIBEVENT_BREAKER_CLOSED;
+			host->calls = host->failures = host->slow = 0;
+		}
+		return;
+	}
+	if (host->breaker != CURL_LIBEVENT_BREAKER_CLOSED)
+		return;	/* started before opened */
+	host->calls++;
+	if (failed)
+		host->failures++;
+	if (slow)
+		host->slow++;
+	if (host->calls >= conf->min_calls &&
+	    ((conf->failure_pct > 0 &&
+	    host->failures * 100 >= host->calls * conf->failure_pct) ||
+	    (conf->slow_pct > 0 &&
+	    host->slow * 100 >= host->calls * conf->slow_pct))) {
+		curl_libevent_breaker_open(self, host);
+		return;
+	}
+	if (host->calls >= conf->min_calls * 4) {
+		/* follow the recent calls */
+		host->calls /= 2;
+		host->failures /= 2;
+		host->slow /= 2;
+	}
+}
+
+void
+curl_libevent_breaker_open(struct curl_libevent *self,
+    struct curl_libevent_host *host)
+{
+	host->breaker = CURL_LIBEVENT_BREAKER_OPEN;
+	host->opened_at = curl_libevent_wheel_ticks(self);
+	host->opened++;
+	host->calls = host->failures = host->slow = 0;
+}
+
+/************************************************************************
+ * hedging and mirrors
+ ************************************************************************/
+/*
+ * A hedged request starts a duplicate of the transfer by
+ * curl_easy_duphandle() if it is not done within the delay, the given
+ * one or the p95 latency of the host.  A request on mirrors starts the
+ * duplicates on the other URLs in the same way, one by one, and fails
+ * over to the next one at once when a transfer fails.  The first success
+ * wins and the others are removed, and a failure waits for the others
+ * still running.  The bodies of them are kept by the library, so the
+ * request gets the one of the winner through curl_libevent_get_response().
+ * Each transfer started earns the budget ratio and a hedge spends 1, so
+ * the extra transfers of hedging are bounded.
+ */
+void
+curl_libevent_set_hedge_budget(struct curl_libevent *self, double ratio)
+{
+	self->hedge_ratio = ratio;
+	if (ratio <= 0)
+		self->hedge_tokens = 0;
+}
+
+/* Arm the timer of the hedge when the transfer starts */
+void
+curl_libevent_hedge_arm(struct curl_libevent *self,
+    struct curl_libevent_curl *curl)
+{
+	struct curl_libevent_hedge	*hedge = curl->hedge;
+	struct timeval			 tv;
+	uint64_t			 usec;
+
+	if (hedge->urls != NULL && hedge->delay_ms == 0) {
+		/* all the mirrors at once */
+		while (hedge->next < hedge->nurls)
+			curl_libevent_hedge_next(self, hedge);
+		return;
+	}
+	if (hedge->delay_ms != CURL_LIBEVENT_HEDGE_AUTO)
+		usec = (uint64_t)hedge->delay_ms * 1000;
+	else if (curl->host == NULL ||
+	    (usec = curl_libevent_host_percentile(curl->host, 95)) == 0)
+		return;	/* not learned yet */
+	tv.tv_sec = usec / 1000000;
+	tv.tv_usec = usec % 1000000;
+	evtimer_add(&hedge->ev_timer, &tv);
+}
+
+void
+curl_libevent_hedge_on_timer(int fd, short evmask, void *ctx)
+{
+	struct curl_libevent_hedge	*hedge = ctx;
+	struct curl_libevent_curl	*primary = hedge->primary, *curl;
+	struct curl_libevent		*self = primary->parent;
+
+	if (hedge->urls != NULL) {
+		curl_libevent_hedge_next(self, hedge);
+		if (hedge->next < hedge->nurls)
+			curl_libevent_hedge_arm(self, primary);
+		return;
+	}
+	if (primary->state != CURL_LIBEVENT_CURL_ACTIVE ||
+	    (self->max_active > 0 && self->nactive >= self->max_active) ||
+	    self->hedge_tokens < 1) {
+		self->stats.hedge_denied++;
+		return;
+	}
+	if ((curl = curl_libevent_hedge_spawn(hedge, NULL)) == NULL)
+		return;
+	self->hedge_tokens -= 1;
+	self->stats.hedged++;
+	curl_libevent_start(self, curl);
+}
+
+/* Duplicate the request, on the URL if given */
+struct curl_libevent_curl *
+curl_libevent_hedge_spawn(struct curl_libevent_hedge *hedge, const char *url)
+{
+	struct curl_libevent_curl	*primary = hedge->primary, *curl;
+	struct curl_libevent		*self = primary->parent;
+	CURL				*handle;
+	char				 host[256];
+
+	if ((handle = curl_easy_duphandle(primary->handle)) == NULL)
+		return (NULL);
+	if (url != NULL)
+		curl_easy_setopt(handle, CURLOPT_URL, url);
+	curl = curl_libevent_curl_alloc(self);
+	curl->parent = self;
+	curl->handle = handle;
+	curl->priority = primary->priority;
+	curl->tenant = primary->tenant;
+	curl->tenant->refs++;
+	if (url != NULL && curl_libevent_track_hosts(self))
+		curl->host = (curl_libevent_host(handle, host,
+		    sizeof(host)) == 0)? curl_libevent_host_get(self, host) :
+		    NULL;
+	else if ((curl->host = primary->host) != NULL)
+		curl_libevent_host_ref(self, curl->host);
+	curl->hedge = hedge;
+	LIST_INSERT_HEAD(&hedge->dups, curl, hedged);
+	hedge->ndups++;
+	curl_libevent_buffer(curl);
+	curl_libevent_hash_insert(self, curl);
+
+	return (curl);
+}
+
+/* Start the transfer on the next mirror */
+void
+curl_libevent_hedge_next(struct curl_libevent *self,
+    struct curl_libevent_hedge *hedge)
+{
+	struct curl_libevent_curl	*curl;
+
+	while (hedge->next < hedge->nurls) {
+		if ((curl = curl_libevent_hedge_spawn(hedge,
+		    hedge->urls[hedge->next++])) == NULL)
+			continue;
+		if (!curl_libevent_breaker_allow(self, curl)) {
+			/* skip the mirror */
+			curl->host->rejected++;
+			self->stats.circuit_open++;
+			curl_libevent_hedge_drop(self, curl);
+			continue;
+		}
+		self->stats.mirrored++;
+		curl_libevent_admit(self, curl);
+		break;
+	}
+}
+
+/* One of the transfers of the request is done */
+void
+curl_libevent_hedge_done(struct curl_libevent *self,
+    struct curl_libevent_curl *curl, CURLMsg *msg)
+{
+	struct curl_libevent_hedge	*hedge = curl->hedge;
+	struct curl_libevent_curl	*primary = hedge->primary;
+	CURLMsg				 wmsg;
+
+	/* the message is gone with the duplicate */
+	memset(&wmsg, 0, sizeof(wmsg));
+	wmsg.msg = CURLMSG_DONE;
+	wmsg.easy_handle = primary->handle;
+	wmsg.data.result = msg->data.result;
+
+	if (msg->data.result == CURLE_OK) {
+		if (curl != primary) {
+			/* hand the body of the winner over to the request */
+			if (hedge->urls == NULL)
+				self->stats.hedge_wins++;
+			curl->body->resp.result = CURLE_OK;
+			curl_easy_getinfo(curl->handle, CURLINFO_RESPONSE_CODE,
+			    &curl->body->resp.code);
+			curl_libevent_body_unref(primary->body);
+			primary->body = curl_libevent_body_ref(curl->body);
+			primary->buffering = false;
+		}
+		curl_libevent_unlink(self, primary);
+		curl_libevent_hedge_free(self, primary);
+		curl_libevent_finish(self, primary, &wmsg);
+		return;
+	}
+
+	hedge->result = msg->data.result;
+	if (curl == primary) {
+		/* wait for the others */
+		curl_libevent_deactivate(self, primary);
+		primary->state = CURL_LIBEVENT_CURL_RACING;
+		TAILQ_INSERT_TAIL(&self->racing, primary, next);
+	} else
+		curl_libevent_hedge_drop(self, curl);
+	if (hedge->next < hedge->nurls) {
+		/* fail over without waiting for the stagger */
+		event_del(&hedge->ev_timer);
+		curl_libevent_hedge_next(self, hedge);
+		if (hedge->next < hedge->nurls)
+			curl_libevent_hedge_arm(self, primary);
+	}
+	if (primary->state == CURL_LIBEVENT_CURL_RACING && hedge->ndups == 0) {
+		/* all failed */
+		wmsg.data.result = hedge->result;
+		curl_libevent_unlink(self, primary);
+		curl_libevent_hedge_free(self, primary);
+		curl_libevent_finish(self, primary, &wmsg);
+		return;
+	}
+	curl_libevent_promote(self);
+}
+
+/* Remove the duplicate wherever it is */
+void
+curl_libevent_hedge_drop(struct curl_libevent *self,
+    struct curl_libevent_curl *curl)
+{
+	LIST_REMOVE(curl, hedged);
+	curl->hedge->ndups--;
+	curl->hedge = NULL;
+	curl_libevent_unlink(self, curl);
+	curl_libevent_hash_remove(self, curl);
+	curl_easy_cleanup(curl->handle);
+	curl_libevent_body_unref(curl->body);
+	curl_libevent_curl_free(self, curl);
+}
+
+/* Release the hedge of the request with the duplicates if any */
+void
+curl_libevent_hedge_free(struct curl_libevent *self,
+    struct curl_libevent_curl *primary)
+{
+	struct curl_libevent_hedge	*hedge = primary->hedge;
+	struct curl_libevent_curl	*curl;
+	unsigned			 i;
+
+	event_del(&hedge->ev_timer);
+	while ((curl = LIST_FIRST(&hedge->dups)) != NULL)
+		curl_libevent_hedge_drop(self, curl);
+	for (i = 0; i < hedge->nurls; i++)
+		xfree(hedge->urls[i]);
+	xfree(hedge->urls);
+	primary->hedge = NULL;
+	xfree(hedge);
+}
+
+/************************************************************************
+ * retries
+ ************************************************************************/
+/*
+ * A transfer failed by a class of the retry policy is started again after
+ * the backoff, a random time up to base_ms * 2^n capped to max_ms, unless
+ * the attempts, the deadline or the budget run out.  Retry-After of the
+ * response is honored as the lower bound.  Like hedging, each transfer
+ * started earns the budget ratio and a retry spends 1, so retries don't
+ * amplify the load much in an outage.  Unless the body is buffered by the
+ * library, only the failures to connect are retried without the reset
+ * callback, since the caller has seen the data of the failed attempt.
+ */
+void
+curl_libevent_set_retry_budget(struct curl_libevent *self, double ratio)
+{
+	self->retry_ratio = ratio;
+	if (ratio <= 0)
+		self->retry_tokens = 0;
+}
+
+/* Back off if the transfer is to retry */
+bool
+curl_libevent_retry_schedule(struct curl_libevent *self,
+    struct curl_libevent_curl *curl, CURLMsg *msg)
+{
+	struct curl_libevent_retry	*retry = &curl->retry;
+	struct timeval			 tv;
+	curl_off_t			 after = 0;
+	uint64_t			 cap, delay;
+	long				 code = 0;
+	unsigned			 class;
+
+	if (curl->attempts + 1 >= retry->max_attempts || curl->hedge != NULL)
+		return (false);
+	switch (msg->data.result) {
+	case CURLE_COULDNT_RESOLVE_PROXY:
+	case CURLE_COULDNT_RESOLVE_HOST:
+	case CURLE_COULDNT_CONNECT:
+		class = CURL_LIBEVENT_RETRY_CONNECT;
+		break;
+	case CURLE_OPERATION_TIMEDOUT:
+		class = CURL_LIBEVENT_RETRY_TIMEOUT;
+		break;
+	case CURLE_PARTIAL_FILE:
+	case CURLE_HTTP2:
+	case CURLE_GOT_NOTHING:
+	case CURLE_SEND_ERROR:
+	case CURLE_RECV_ERROR:
+	case CURLE_HTTP2_STREAM:
+		class = CURL_LIBEVENT_RETRY_TRANSFER;
+		break;
+	case CURLE_OK:
+	case CURLE_HTTP_RETURNED_ERROR:
+		curl_easy_getinfo(curl->handle, CURLINFO_RESPONSE_CODE, &code);
+		if (code == 429)
+			class = CURL_LIBEVENT_RETRY_429;
+		else if (code == 502 || code == 503 || code == 504)
+			class = CURL_LIBEVENT_RETRY_5XX;
+		else
+			return (false);
+		curl_easy_getinfo(curl->handle, CURLINFO_RETRY_AFTER, &after);
+		break;
+	default:
+		return (false);
+	}
+	if ((retry->classes & class) == 0)
+		return (false);
+	/* the data of the failed attempt may have gone to the caller */
+	if (class != CURL_LIBEVENT_RETRY_CONNECT && !curl->buffering &&
+	    retry->reset == NULL)
+		return (false);
+
+	cap = (curl->attempts < 32)?
+	    (uint64_t)retry->base_ms << curl->attempts : UINT64_MAX;
+	cap = MINIMUM(cap, retry->max_ms);
+	delay = (cap > 0)? curl_libevent_random(self) % (cap + 1) : 0;
+	if (after > 0) {
+		if ((uint64_t)after * 1000 > retry->max_ms)
+			return (false);	/* not worth waiting */
+		delay = MAXIMUM(delay, (uint64_t)after * 1000);
+	}
+	if (curl->expires != 0 &&
+	    curl_libevent_wheel_ticks(self) + delay >= curl->expires)
+		return (false);	/* the deadline comes first */
+	if (self->retry_tokens < 1) {
+		self->stats.retry_denied++;
+		return (false);
+	}
+	self->retry_tokens -= 1;
+	self->stats.retried++;
+	curl->attempts++;
+
+	curl_libevent_deactivate(self, curl);
+	curl->state = CURL_LIBEVENT_CURL_RETRYING;
+	TAILQ_INSERT_TAIL(&self->retrying, curl, next);
+	if (curl->buffering)
+		curl->body->resp.len = 0;	/* not shared yet */
+	curl->ev_retry = xcalloc(1, sizeof(*curl->ev_retry));
+	evtimer_set(curl->ev_retry, curl_libevent_retry_on_timer, curl);
+	if (self->eb != NULL)
+		event_base_set(self->eb, curl->ev_retry);
+	tv.tv_sec = delay / 1000;
+	tv.tv_usec = (delay % 1000) * 1000;
+	evtimer_add(curl->ev_retry, &tv);
+	curl_libevent_promote(self);
+
+	return (true);
+}
+
+void
+curl_libevent_retry_on_timer(int fd, short evmask, void *ctx)
+{
+	struct curl_libevent_curl	*curl = ctx;
+	struct curl_libevent		*self = curl->parent;
+	void				*priv = NULL;
+
+	curl_libevent_unlink(self, curl);
+	if (curl->retry.reset != NULL && !curl->buffering) {
+		curl_easy_getinfo(curl->handle, CURLINFO_PRIVATE, &priv);
+		curl->retry.reset(priv, curl->handle);
+	}
+	if (!curl_libevent_breaker_allow(self, curl))
+		curl_libevent_breaker_trip(self, curl);
+	else
+		curl_libevent_admit(self, curl);
+}
+
+/* splitmix64, good enough for the jitter */
+uint64_t
+curl_libevent_random(struct curl_libevent *self)
+{
+	uint64_t	 z;
+
+	z = (self->rand_state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+
+	return (z ^ (z >> 31));
+}
+
+/************************************************************************
+ * share
+ ************************************************************************/
+/*
+ * A CURLSH shared by instances, possibly running on different threads.
+ * The DNS cache and the TLS sessions are shared and the share is attached
+ * to every handle in curl_libevent_perform().  The connection cache is
+ * not, libcurl doesn't support sharing it by the concurrent threads; the
+ * connections are reused within an instance by its multi handle.
+ */
+struct curl_libevent_share *
+curl_libevent_share_create(void)
+{
+	struct curl_libevent_share	*self;
+	int				 i;
+
+	self = xcalloc(1, sizeof(*self));
+	if ((self->handle = curl_share_init()) == NULL) {
+		xfree(self);
+		return (NULL);
+	}
+	for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+		MUTEX_INIT(&self->locks[i]);
+	MUTEX_INIT(&self->stats_mtx);
+	curl_share_setopt(self->handle, CURLSHOPT_LOCKFUNC,
+	    curl_libevent_share_lock);
+	curl_share_setopt(self->handle, CURLSHOPT_UNLOCKFUNC,
+	    curl_libevent_share_unlock);
+	curl_share_setopt(self->handle, CURLSHOPT_USERDATA, self);
+	curl_share_setopt(self->handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(self->handle, CURLSHOPT_SHARE,
+	    CURL_LOCK_DATA_SSL_SESSION);
+
+	return (self);
+}
+
+CURLSH *
+curl_libevent_share_handle(struct curl_libevent_share *self)
+{
+	return (self->handle);
+}
+
+/*
+ * libcurl doesn't tell whether a cache was hit, so the numbers are
+ * derived from the completed transfers: a transfer which made no new
+ * connection reused a connection of its instance, and a new connection
+ * whose name lookup took less than 1ms is estimated to hit the DNS cache.
+ * The estimate counts the IP addresses and the names in the hosts file
+ * as hits as well.
+ */
+void
+curl_libevent_share_get_stats(struct curl_libevent_share *self,
+    struct curl_libevent_share_stats *stats)
+{
+	MUTEX_LOCK(&self->stats_mtx);
+	*stats = self->stats;
+	MUTEX_UNLOCK(&self->stats_mtx);
+}
+
+/* Must be called after the instances using the share are destroyed */
+void
+curl_libevent_share_destroy(struct curl_libevent_share *self)
+{
+	int	 i;
+
+	curl_share_cleanup(self->handle);
+	for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+		MUTEX_DESTROY(&self->locks[i]);
+	MUTEX_DESTROY(&self->stats_mtx);
+	xfree(self);
+}
+
+void
+curl_libevent_set_share(struct curl_libevent *self,
+    struct curl_libevent_share *share)
+{
+	self->share = share;
+}
+
+void
+curl_libevent_share_account(struct curl_libevent_share *self, CURL *handle)
+{
+	long		 nconnects = 0;
+	curl_off_t	 namelookup = 0;
+
+	curl_easy_getinfo(handle, CURLINFO_NUM_CONNECTS, &nconnects);
+	curl_easy_getinfo(handle, CURLINFO_NAMELOOKUP_TIME_T, &namelookup);
+	MUTEX_LOCK(&self->stats_mtx);
+	if (nconnects == 0)
+		self->stats.conn_hits++;
+	else {
+		self->stats.conn_misses++;
+		if (namelookup < 1000)
+			self->stats.dns_hits++;
+		else
+			self->stats.dns_misses++;
+	}
+	MUTEX_UNLOCK(&self->stats_mtx);
+}
+
+void
+curl_libevent_share_lock(CURL *handle, curl_lock_data data,
+    curl_lock_access access, void *userptr)
+{
+	struct curl_libevent_share	*self = userptr;
+
+	if (data >= 0 && data < CURL_LOCK_DATA_LAST)
+		MUTEX_LOCK(&self->locks[data]);
+}
+
+void
+curl_libevent_share_unlock(CURL *handle, curl_lock_data data,
+    void *userptr)
+{
+	struct curl_libevent_share	*self = userptr;
+
+	if (data >= 0 && data < CURL_LOCK_DATA_LAST)
+		MUTEX_UNLOCK(&self->locks[data]);
+}
+
+/************************************************************************
+ * sharded engine
+ ************************************************************************/
+/*
+ * N worker threads, each of them owns an event_base and a curl_libevent.
+ * curl_libevent_shards_perform() may be called from any thread and
+ * routes the request to a shard.  The on_done callbacks are called on the
+ * thread of the shard.
+ */
+struct curl_libevent_shard {
+	struct curl_libevent_shards
+				*parent;
+	struct event_base	*eb;
+	struct curl_libevent	*evcurl;
+	curl_libevent_thread_t	 thread;
+	evutil_socket_t		 pairs[2];	/* to stop the thread */
+	struct event		 ev_pairs;
+	unsigned		 load;		/* atomic */
+};
+
+struct curl_libevent_shards {
+	int			 nshards;
+	int			 policy;
+	unsigned		 rr;		/* atomic */
+	struct curl_libevent_shard
+				*shards;
+};
+
+struct curl_libevent_shards *
+curl_libevent_shards_create(int nshards, int policy,
+    void (*init)(struct curl_libevent *, void *), void *arg)
+{
+	struct curl_libevent_shards	*self;
+	struct curl_libevent_shard	*shard;
+	int				 i;
+
+	if (nshards <= 0)
+		return (NULL);
+	self = xcalloc(1, sizeof(*self));
+	self->policy = policy;
+	self->shards = xcalloc(nshards, sizeof(self->shards[0]));
+
+	for (i = 0; i < nshards; i++) {
+		shard = &self->shards[i];
+		shard->parent = self;
+		shard->pairs[0] = shard->pairs[1] = -1;
+		if ((shard->eb = event_base_new()) == NULL)
+			goto fail;
+		if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, shard->pairs)
+		    == -1)
+			goto fail;
+		event_set(&shard->ev_pairs, shard->pairs[0], EV_READ,
+		    curl_libevent_shard_on_stop, shard);
+		event_base_set(shard->eb, &shard->ev_pairs);
+		event_add(&shard->ev_pairs, NULL);
+		shard->evcurl = curl_libevent_create(shard->eb);
+		shard->evcurl->on_complete = curl_libevent_shard_on_complete;
+		shard->evcurl->on_complete_arg = shard;
+		if (init != NULL)
+			init(shard->evcurl, arg);
+		/* the instance is handed over to the thread from here */
+		if (THREAD_CREATE(&shard->thread, curl_libevent_shard_main,
+		    shard) != 0)
+			goto fail;
+		self->nshards++;
+	}
+
+	return (self);
+ fail:
+	warnx("%s: failed to create a shard", __func__);
+	curl_libevent_shard_fini(shard);
+	curl_libevent_shards_destroy(self);
+
+	return (NULL);
+}
+
+void
+curl_libevent_shards_perform(struct curl_libevent_shards *self, CURL *handle,
+    void (*on_done)(void *, CURLMsg *))
+{
+	struct curl_libevent_shard	*shard;
+	char				 host[256];
+	unsigned			 i, load, min;
+
+	switch (self->policy) {
+	case CURL_LIBEVENT_SHARD_LEASTLOADED:
+		shard = &self->shards[0];
+		min = ATOMIC_LOAD(&shard->load);
+		for (i = 1; i < (unsigned)self->nshards; i++) {
+			if ((load = ATOMIC_LOAD(&self->shards[i].load)) < min) {
+				shard = &self->shards[i];
+				min = load;
+			}
+		}
+		break;
+	case CURL_LIBEVENT_SHARD_HOSTHASH:
+		/* keep a host on a shard so that its connections are reused */
+		if (curl_libevent_host(handle, host, sizeof(host)) == 0) {
+			shard = &self->shards[curl_libevent_strhash(host) %
+			    self->nshards];
+			break;
+		}
+		/* FALLTHROUGH */
+	case CURL_LIBEVENT_SHARD_ROUNDROBIN:
+	default:
+		shard = &self->shards[ATOMIC_ADD(&self->rr, 1) %
+		    self->nshards];
+		break;
+	}
+	ATOMIC_ADD(&shard->load, 1);
+	curl_libevent_submit_internal(shard->evcurl, handle, on_done, true);
+}
+
+struct curl_libevent *
+curl_libevent_shards_get(struct curl_libevent_shards *self, int idx)
+{
+	if (idx < 0 || idx >= self->nshards)
+		return (NULL);
+	return (self->shards[idx].evcurl);
+}
+
+void
+curl_libevent_shards_destroy(struct curl_libevent_shards *self)
+{
+	struct curl_libevent_shard	*shard;
+	int				 i;
+
+	for (i = 0; i < self->nshards; i++) {
+		shard = &self->shards[i];
+		send(shard->pairs[1], "", 1, 0);
+	}
+	for (i = 0; i < self->nshards; i++) {
+		shard = &self->shards[i];
+		THREAD_JOIN(shard->thread);
+		curl_libevent_shard_fini(shard);
+	}
+	xfree(self->shards);
+	xfree(self);
+}
+
+/* Release a shard whose thread is not running */
+void
+curl_libevent_shard_fini(struct curl_libevent_shard *shard)
+{
+	if (shard->evcurl != NULL)
+		curl_libevent_destroy(shard->evcurl);
+	if (shard->pairs[0] != -1) {
+		event_del(&shard->ev_pairs);
+		evutil_closesocket(shard->pairs[0]);
+		evutil_closesocket(shard->pairs[1]);
+	}
+	if (shard->eb != NULL)
+		event_base_free(shard->eb);
+}
+
+CURL_LIBEVENT_THREAD_FUNC
+curl_libevent_shard_main(void *ctx)
+{
+	struct curl_libevent_shard	*shard = ctx;
+
+	event_base_dispatch(shard->eb);
+
+	return (0);
+}
+
+void
+curl_libevent_shard_on_stop(evutil_socket_t fd, short evmask, void *ctx)
+{
+	struct curl_libevent_shard	*shard = ctx;
+
+	event_base_loopbreak(shard->eb);
+}
+
+void
+curl_libevent_shard_on_complete(struct curl_libevent *evcurl, void *ctx)
+{
+	struct curl_libevent_shard	*shard = ctx;
+	unsigned			 load;
+
+	/* a wrapped count would keep the shard the least loaded */
+	do {
+		if ((load = ATOMIC_LOAD(&shard->load)) == 0)
+			return;
+	} while (!ATOMIC_CAS(&shard->load, load, load - 1));
+}
+
+/************************************************************************
+ * miscellaneous
+ ************************************************************************/
+/* Get the host name of the URL of the easy handle */
+int
+curl_libevent_host(CURL *handle, char *buf, size_t bufsiz)
+{
+	char	*url, *host = NULL;
+	CURLU	*u;
+	int	 ret = -1;
+
+	if (curl_easy_getinfo(handle, CURLINFO_EFFECTIVE_URL, &url) !=
+	    CURLE_OK || url == NULL || *url == '\0')
+		return (-1);
+	if ((u = curl_url()) == NULL)
+		return (-1);
+	if (curl_url_set(u, CURLUPART_URL, url, 0) == CURLUE_OK &&
+	    curl_url_get(u, CURLUPART_HOST, &host, 0) == CURLUE_OK) {
+		if ((size_t)snprintf(buf, bufsiz, "%s", host) < bufsiz)
+			ret = 0;
+		curl_free(host);
+	}
+	curl_url_cleanup(u);
+
+	return (ret);
+}
+
+/* FNV-1a */
+unsigned
+curl_libevent_strhash(const char *str)
+{
+	uint32_t	 h = 2166136261U;
+
+	for (; *str != '\0'; str++) {
+		h ^= (unsigned char)*str;
+		h *= 16777619U;
+	}
+
+	return (h);
+}
+
+char *
+curl_libevent_strdup(const char *str)
+{
+	char	*ret;
+	size_t	 len;
+
+	len = strlen(str);
+	ret = xcalloc(1, len + 1);
+	memcpy(ret, str, len);
+
+	return (ret);
+}
+
+#ifndef _WIN32
+void *
+curl_libevent_xcalloc(size_t nmemb, size_t size)
+{
+	void	*ret = calloc(nmemb, size);
+	if (ret == NULL)
+		err(1, "calloc");
+	return (ret);
+}
+#endif
+
+#ifdef _WIN32
+void
+curl_libevent_winhttp_callback(HINTERNET hInternet, DWORD_PTR dwContext,
+    DWORD dwInternetStatus, LPVOID lpvStatusInformation,
+    DWORD dwStatusInformationLength)
+{
+	struct curl_libevent_curl	*curl;
+	struct curl_libevent		*self;
+	struct pair_event		 ev;
+
+	curl = dwContext;
+	self = curl->parent;
+	ev.context = dwContext;
+	if (dwInternetStatus == WINHTTP_CALLBACK_STATUS_GETPROXYFORURL_COMPLETE)
+		ev.dwError = NO_ERROR;
+	else if (dwInternetStatus == WINHTTP_CALLBACK_STATUS_REQUEST_ERROR)
+		ev.dwError = ((PWINHTTP_ASYNC_RESULT)lpvStatusInformation)->dwError;
+	send(self->pairs[1], &ev, sizeof(ev), 0);
+}
+
+void
+curl_libevent_on_pairs_event(intptr_t fd, short ev0, void *ctx)
+{
+	struct pair_event		 ev;
+	SSIZE_T				 sz;
+	struct curl_libevent		*self = ctx;
+	struct curl_libevent_curl	*curl;
+	WINHTTP_PROXY_RESULT		 proxyResult;
+	char				*proxy;
+	size_t				 proxylen;
+
+	if ((sz = recv(fd, &ev, sizeof(ev), 0)) == -1)
+		warnx("%s; recv() failed: %u", WSAGetLastError());
+	if (sz != sizeof(ev)) {
+		warnx("%s; recv() wrong size: %zd", sz);
+		return;
+	}
+	curl = ev.context;
+	if (ev.dwError != NO_ERROR) {
+		warnx("%s: GetProxy failed %u", __func__, ev.dwError);
+		goto out;
+	}
+	memset(&proxyResult, 0, sizeof(proxyResult));
+	WinHttpGetProxyResult(curl->hProxyResolv, &proxyResult);
+	if (proxyResult.cEntries <= 0) {
+		warnx("%s: cEntries=%d", __func__, proxyResult.cEntries);
+		goto out;
+	}
+	WINHTTP_PROXY_RESULT_ENTRY *result = &proxyResult.pEntries[0];
+	if (result->fProxy && !result->fBypass) {
+		proxylen = wcslen(result->pwszProxy);
+		proxy = xcalloc(1, proxylen + 1);
+		WideCharToMultiByte(CP_UTF8, 0, result->pwszProxy, -1,
+		    proxy, proxylen + 1, NULL, FALSE);
 		curl_easy_setopt(curl->handle, CURLOPT_PROXY, proxy);
 		curl_easy_setopt(curl->handle, CURLOPT_PROXYPORT,
 		    result->ProxyPort);
@@ -489,7 +5181,10 @@ curl_libevent_on_pairs_event(intptr_t fd, short ev0, void *ctx)
  out:
 	WinHttpCloseHandle(curl->hProxyResolv);
 	curl->hProxyResolv = INVALID_HANDLE_VALUE;
-	curl_multi_add_handle(self->handle, curl->handle);
+	if (curl->aborted != CURLE_OK)
+		curl_libevent_abort(self, curl, curl->aborted);
+	else
+		curl_multi_add_handle(self->handle, curl->handle);
 }
 
 static void
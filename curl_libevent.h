@@ -17,6 +17,7 @@
 #define CURL_LIBEVENT_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <event.h>
 #include <curl/curl.h>
 
@@ -24,14 +25,247 @@
 extern "C" {
 #endif
 struct curl_libevent;
+
+#define CURL_LIBEVENT_PRIO_BULK		0
+#define CURL_LIBEVENT_PRIO_NORMAL	1
+#define CURL_LIBEVENT_PRIO_INTERACTIVE	2
+#define CURL_LIBEVENT_NPRIO		3
+
+/* the failures to retry */
+#define CURL_LIBEVENT_RETRY_CONNECT	0x01	/* couldn't resolve or connect */
+#define CURL_LIBEVENT_RETRY_TIMEOUT	0x02
+#define CURL_LIBEVENT_RETRY_TRANSFER	0x04	/* the connection broke */
+#define CURL_LIBEVENT_RETRY_5XX		0x08	/* HTTP 502, 503 and 504 */
+#define CURL_LIBEVENT_RETRY_429		0x10	/* HTTP 429 */
+#define CURL_LIBEVENT_RETRY_DEFAULT	0x1f
+
+struct curl_libevent_retry {
+	unsigned	 max_attempts;	/* including the first, 0 if none */
+	unsigned	 classes;	/* CURL_LIBEVENT_RETRY_* */
+	unsigned	 base_ms;	/* the backoff of the first retry */
+	unsigned	 max_ms;	/* the backoff is capped to */
+	/* discards the data written by the failed attempt, see README */
+	void		(*reset)(void *, CURL *);
+};
+
+struct curl_libevent_attr {
+	int		 priority;	/* CURL_LIBEVENT_PRIO_* */
+	unsigned	 tenant;	/* tenant or flow id, 0 by default */
+	const char	*rate_key;	/* rate limit key, the host if NULL */
+	/* the transfer is shaped if the callbacks are given here */
+	curl_write_callback
+			 write_function;
+	void		*write_data;
+	curl_read_callback
+			 read_function;
+	void		*read_data;
+	unsigned	 bw_weight;	/* share of the bandwidth */
+	unsigned	 deadline_ms;	/* including the time queued, 0 if none */
+	uintptr_t	 tag;		/* for curl_libevent_cancel_tag() */
+	/* coalesced with the others of the same URL and key if given */
+	const char	*coalesce_key;
+	/* cached by the URL and the key if given */
+	const char	*cache_key;
+	struct curl_slist
+			*headers;	/* instead of CURLOPT_HTTPHEADER */
+	unsigned	 hedge_ms;	/* duplicate after, 0 if none */
+	const struct curl_libevent_retry
+			*retry;		/* NULL if none */
+};
+
+#define CURL_LIBEVENT_HEDGE_AUTO	((unsigned)-1)	/* p95 of the host */
+
+struct curl_libevent_stats {
+	uint64_t	 easy_hits;	/* handles reused from the pool */
+	uint64_t	 easy_misses;	/* handles newly created */
+	uint64_t	 rejected;	/* the pending queue was full */
+	uint64_t	 ratelimited;	/* waited for a token */
+	uint64_t	 cancelled;
+	uint64_t	 coalesced;	/* merged into a transfer in flight */
+	uint64_t	 hedged;	/* duplicates started */
+	uint64_t	 hedge_wins;	/* the duplicate completed first */
+	uint64_t	 hedge_denied;	/* by the budget or the limit */
+	uint64_t	 mirrored;	/* transfers to the other mirrors */
+	uint64_t	 retried;
+	uint64_t	 retry_denied;	/* by the budget */
+	uint64_t	 circuit_open;	/* failed fast by the breakers */
+	uint64_t	 sock_updates;	/* event_add() or event_del() */
+	uint64_t	 sock_unchanged;	/* socket callbacks skipped */
+};
+
+/* adaptive concurrency limit */
+#define CURL_LIBEVENT_LIMIT_NONE	0
+#define CURL_LIBEVENT_LIMIT_AIMD	1
+#define CURL_LIBEVENT_LIMIT_GRADIENT	2
+
+/* circuit breaker */
+#define CURL_LIBEVENT_E_CIRCUIT_OPEN	((CURLcode)1000)	/* failed fast */
+#define CURL_LIBEVENT_BREAKER_CLOSED	0
+#define CURL_LIBEVENT_BREAKER_OPEN	1
+#define CURL_LIBEVENT_BREAKER_HALF_OPEN	2
+
+struct curl_libevent_breaker {
+	unsigned	 min_calls;	/* to judge the host, 0 to disable */
+	unsigned	 failure_pct;	/* opens at the rate of failures */
+	unsigned	 slow_ms;	/* a slower call is slow, 0 if none */
+	unsigned	 slow_pct;	/* opens at the rate of slow calls */
+	unsigned	 open_ms;	/* until half-open */
+	unsigned	 probes;	/* succeeded half-open to close */
+};
+
+struct curl_libevent_breaker_stats {
+	int		 state;		/* CURL_LIBEVENT_BREAKER_* */
+	unsigned	 calls;		/* in the window */
+	unsigned	 failures;
+	unsigned	 slow;
+	uint64_t	 opened;	/* times opened */
+	uint64_t	 rejected;	/* failed fast */
+};
+
+struct curl_libevent_cache_stats {
+	uint64_t	 hits;
+	uint64_t	 misses;
+	uint64_t	 revalidations;	/* conditional requests sent */
+	uint64_t	 not_modified;	/* answered 304 */
+	uint64_t	 stores;
+	uint64_t	 evictions;
+	size_t		 bytes;
+	unsigned	 entries;
+};
+
+struct curl_libevent_response {
+	CURLcode	 result;
+	long		 code;		/* the HTTP response code */
+	const char	*data;		/* the body */
+	size_t		 len;
+};
+
+/* a completion delivered in a batch */
+struct curl_libevent_completion {
+	void		*ctx;		/* CURLOPT_PRIVATE */
+	CURL		*easy;
+	CURLcode	 result;
+	const struct curl_libevent_response
+			*response;	/* if kept by the library */
+};
+
+struct curl_libevent_tenant_stats {
+	unsigned	 active;
+	unsigned	 pending;	/* the queue depth */
+	uint64_t	 started;
+	uint64_t	 rejected;
+	uint64_t	 waited;	/* transfers started from the queue */
+	uint64_t	 wait_usec;	/* total time waited in the queue */
+	uint64_t	 wait_usec_max;
+};
+
+struct curl_libevent_bandwidth_stats {
+	curl_off_t	 recv_limit;	/* configured, bytes per second */
+	curl_off_t	 send_limit;
+	double		 recv_rate;	/* achieved, bytes per second */
+	double		 send_rate;
+	uint64_t	 recv_bytes;
+	uint64_t	 send_bytes;
+	uint64_t	 pauses;
+};
+
 struct curl_libevent
 	*curl_libevent_create(struct event_base *);
 CURLM	*curl_libevent_handle(struct curl_libevent *);
 void	 curl_libevent_set_auto_proxy_config(struct curl_libevent *, bool);
+void	 curl_libevent_set_pool_size(struct curl_libevent *, unsigned,
+	    unsigned);
+void	 curl_libevent_set_pool_zeroing(struct curl_libevent *, bool);
+void	 curl_libevent_set_deferred_completion(struct curl_libevent *,
+	    bool);
+void	 curl_libevent_set_easy_pool(struct curl_libevent *, unsigned);
+CURL	*curl_libevent_easy_get(struct curl_libevent *);
+void	 curl_libevent_easy_put(struct curl_libevent *, CURL *);
+void	 curl_libevent_get_stats(struct curl_libevent *,
+	    struct curl_libevent_stats *);
+
+void	 curl_libevent_set_max_active(struct curl_libevent *, unsigned);
+void	 curl_libevent_set_max_pending(struct curl_libevent *, unsigned);
+void	 curl_libevent_set_tenant(struct curl_libevent *, unsigned, unsigned,
+	    unsigned, unsigned);
+int	 curl_libevent_get_tenant_stats(struct curl_libevent *, unsigned,
+	    struct curl_libevent_tenant_stats *);
+void	 curl_libevent_set_rate_limit(struct curl_libevent *, const char *,
+	    double, unsigned);
+void	 curl_libevent_set_bandwidth(struct curl_libevent *, curl_off_t,
+	    curl_off_t);
+void	 curl_libevent_get_bandwidth_stats(struct curl_libevent *,
+	    struct curl_libevent_bandwidth_stats *);
+void	 curl_libevent_set_cache(struct curl_libevent *, size_t);
+void	 curl_libevent_set_hedge_budget(struct curl_libevent *, double);
+void	 curl_libevent_set_retry_budget(struct curl_libevent *, double);
+void	 curl_libevent_set_adaptive_limit(struct curl_libevent *, int,
+	    unsigned, unsigned);
+void	 curl_libevent_set_host_adaptive_limit(struct curl_libevent *, int,
+	    unsigned, unsigned);
+unsigned curl_libevent_get_limit(struct curl_libevent *, const char *);
+void	 curl_libevent_set_breaker(struct curl_libevent *,
+	    const struct curl_libevent_breaker *);
+int	 curl_libevent_get_breaker_stats(struct curl_libevent *,
+	    const char *, struct curl_libevent_breaker_stats *);
+void	 curl_libevent_get_cache_stats(struct curl_libevent *,
+	    struct curl_libevent_cache_stats *);
 
-void	 curl_libevent_perform(struct curl_libevent *, CURL *,
+void	 curl_libevent_attr_init(struct curl_libevent_attr *);
+int	 curl_libevent_perform(struct curl_libevent *, CURL *,
+	    void (*on_done)(void *, CURLMsg *));
+int	 curl_libevent_perform_attr(struct curl_libevent *, CURL *,
+	    void (*on_done)(void *, CURLMsg *),
+	    const struct curl_libevent_attr *);
+int	 curl_libevent_perform_mirrors(struct curl_libevent *, CURL *,
+	    const char *const *, unsigned, unsigned,
+	    void (*on_done)(void *, CURLMsg *),
+	    const struct curl_libevent_attr *);
+int	 curl_libevent_cancel(struct curl_libevent *, CURL *);
+int	 curl_libevent_cancel_tag(struct curl_libevent *, uintptr_t);
+const struct curl_libevent_response
+	*curl_libevent_get_response(struct curl_libevent *, CURL *);
+void	 curl_libevent_submit(struct curl_libevent *, CURL *,
 	    void (*on_done)(void *, CURLMsg *));
+void	 curl_libevent_set_batch_done(struct curl_libevent *,
+	    void (*)(void *, const struct curl_libevent_completion *, unsigned),
+	    void *);
+int	 curl_libevent_set_executor(struct curl_libevent *, int);
 void	 curl_libevent_destroy(struct curl_libevent *);
+
+/* share */
+struct curl_libevent_share;
+struct curl_libevent_share_stats {
+	uint64_t	 conn_hits;	/* transfers on a cached connection */
+	uint64_t	 conn_misses;
+	/* estimated by the lookup time, see curl_libevent_share_get_stats() */
+	uint64_t	 dns_hits;	/* new connections on a cached name */
+	uint64_t	 dns_misses;
+};
+
+struct curl_libevent_share
+	*curl_libevent_share_create(void);
+CURLSH	*curl_libevent_share_handle(struct curl_libevent_share *);
+void	 curl_libevent_share_get_stats(struct curl_libevent_share *,
+	    struct curl_libevent_share_stats *);
+void	 curl_libevent_share_destroy(struct curl_libevent_share *);
+void	 curl_libevent_set_share(struct curl_libevent *,
+	    struct curl_libevent_share *);
+
+/* sharded engine */
+#define CURL_LIBEVENT_SHARD_ROUNDROBIN		0
+#define CURL_LIBEVENT_SHARD_LEASTLOADED		1
+#define CURL_LIBEVENT_SHARD_HOSTHASH		2
+
+struct curl_libevent_shards;
+struct curl_libevent_shards
+	*curl_libevent_shards_create(int, int,
+	    void (*)(struct curl_libevent *, void *), void *);
+struct curl_libevent
+	*curl_libevent_shards_get(struct curl_libevent_shards *, int);
+void	 curl_libevent_shards_perform(struct curl_libevent_shards *, CURL *,
+	    void (*on_done)(void *, CURLMsg *));
+void	 curl_libevent_shards_destroy(struct curl_libevent_shards *);
 #ifdef __cplusplus
 }
 #endif
@@ -13,30 +13,156 @@
  * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
 #include <unistd.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <event.h>
+#include <event2/buffer.h>
+#include <event2/http.h>
 #include <paths.h>
+#include <pthread.h>
 #include <err.h>
+#include <signal.h>
 
 #include <curl/curl.h>
 #include "curl_libevent.h"
 
+static void usage(void);
 static void curl_on_done(void *, CURLMsg *);
+static void on_all_done(evutil_socket_t, short, void *);
+static void retry_reset(void *, CURL *);
+static void batch_on_done(void *, const struct curl_libevent_completion *,
+    unsigned);
+static int selftest(struct event_base *);
+static struct evhttp *origin_start(struct event_base *,
+    void (*)(struct evhttp_request *, void *), void *, char *, size_t);
+static void st_origin(struct evhttp_request *, void *);
+static void st_origin_reply(evutil_socket_t, short, void *);
+static CURL *st_perform(int, const char *, const struct curl_libevent_attr *);
+static size_t st_write(char *, size_t, size_t, void *);
+static void st_on_done(void *, CURLMsg *);
+static void st_on_timeout(evutil_socket_t, short, void *);
+static int st_run(struct event_base *, unsigned);
+static void st_expect(int, CURLcode, long, const char *);
+static struct evhttp *st_start(struct event_base *);
+static int coalesce_test(struct event_base *);
+static int hedge_test(struct event_base *);
+static int mirror_test(struct event_base *);
+static void mirror_test_perform(int, const char *, const char *, unsigned);
+static int priority_test(struct event_base *);
+static int rate_test(struct event_base *);
+static int retry_test(struct event_base *);
+static int tenant_test(struct event_base *);
+static int shape_test(struct event_base *);
+static void shape_test_on_done(void *, CURLMsg *);
+static void retry_test_reset(void *, CURL *);
+static int breaker_test(struct event_base *);
+static int cache_test(struct event_base *);
+static int cancel_test(struct event_base *);
+static void cache_test_origin(struct evhttp_request *, void *);
+static void cache_test_request(void);
+static void cache_test_on_done(void *, CURLMsg *);
+static void cache_test_on_timer(int, short, void *);
+static pid_t bench_origin(char *, size_t);
+static void bench_origin_cb(struct evhttp_request *, void *);
+static void events_bench(struct event_base *);
+static void events_bench_request(void);
+static void events_bench_on_done(void *, CURLMsg *);
+static void complete_bench(struct event_base *);
+static int complete_bench_on_connect(void *, char *, char *, int, int);
+static void complete_bench_start(evutil_socket_t, short, void *);
+static void complete_bench_request(void);
+static void complete_bench_on_done(void *, CURLMsg *);
+static void limit_bench(struct event_base *, int);
+static void limit_bench_origin(struct evhttp_request *, void *);
+static void limit_bench_reply(evutil_socket_t, short, void *);
+static void limit_bench_request(void);
+static void limit_bench_on_done(void *, CURLMsg *);
+static int limit_bench_cmp(const void *, const void *);
 
 static int	ncurl = 0;
+static pthread_mutex_t
+		ncurl_mtx = PTHREAD_MUTEX_INITIALIZER;	/* for the workers */
+static int	donepipe[2];	/* the workers wake the loop up */
+static struct curl_libevent
+		*evcurl;
 
 int
 main(int argc, char *argv[])
 {
-	int			 i, ch;
-	struct curl_libevent	*evcurl;
+	int			 i, ch, algo = -1, nworkers = 0;
+	const char		*bench = NULL;
+	bool			 deferred = false, coalesce = false, tests = false;
+	bool			 batch = false;
+	unsigned		 max_active = 0, max_pending = 0;
+	struct curl_libevent_attr
+				 attr;
+	struct curl_libevent_retry
+				 retry;
+	struct curl_libevent_stats
+				 stats;
 	CURL 			*curl;
 	FILE			*fdevnull;
 	struct event_base	*eb;
+	struct event		 ev_done;
 
-	while ((ch = getopt(argc, argv, "")) != -1)
+	curl_libevent_attr_init(&attr);
+	while ((ch = getopt(argc, argv, "a:bc:dmq:r:tw:x:")) != -1)
 		switch (ch) {
+		case 'a':
+			if (strcmp(optarg, "none") == 0)
+				algo = CURL_LIBEVENT_LIMIT_NONE;
+			else if (strcmp(optarg, "aimd") == 0)
+				algo = CURL_LIBEVENT_LIMIT_AIMD;
+			else if (strcmp(optarg, "gradient") == 0)
+				algo = CURL_LIBEVENT_LIMIT_GRADIENT;
+			else
+				usage();
+			break;
+		case 'b':
+			batch = true;
+			break;
+		case 'c':
+			max_active = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			deferred = true;
+			break;
+		case 'm':
+			coalesce = true;
+			break;
+		case 'q':
+			max_pending = strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			memset(&retry, 0, sizeof(retry));
+			retry.max_attempts = strtoul(optarg, NULL, 10);
+			retry.classes = CURL_LIBEVENT_RETRY_DEFAULT;
+			retry.base_ms = 100;
+			retry.max_ms = 2000;
+			retry.reset = retry_reset;
+			attr.retry = &retry;
+			break;
+		case 't':
+			tests = true;
+			break;
+		case 'w':
+			nworkers = strtol(optarg, NULL, 10);
+			break;
+		case 'x':
+			if (strcmp(optarg, "events") != 0 &&
+			    strcmp(optarg, "complete") != 0)
+				usage();
+			bench = optarg;
+			break;
+		default:
+			usage();
 		}
 	argc -= optind;
 	argv += optind;
@@ -47,20 +173,69 @@ main(int argc, char *argv[])
 	eb = event_init();
 	curl_global_init(CURL_GLOBAL_DEFAULT);
 	evcurl = curl_libevent_create(eb);
+	curl_libevent_set_deferred_completion(evcurl, deferred);
+	curl_libevent_set_max_active(evcurl, max_active);
+	curl_libevent_set_max_pending(evcurl, max_pending);
+	if (tests) {
+		i = selftest(eb);
+		curl_libevent_destroy(evcurl);
+		curl_global_cleanup();
+		exit((i == 0)? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+	if (bench != NULL) {
+		if (strcmp(bench, "events") == 0)
+			events_bench(eb);
+		else
+			complete_bench(eb);
+		curl_libevent_destroy(evcurl);
+		curl_global_cleanup();
+		exit(EXIT_SUCCESS);
+	}
+	if (algo != -1) {
+		limit_bench(eb, algo);
+		curl_libevent_destroy(evcurl);
+		curl_global_cleanup();
+		exit(EXIT_SUCCESS);
+	}
+	if (coalesce)
+		attr.coalesce_key = "GET";
+	if (batch)
+		curl_libevent_set_batch_done(evcurl, batch_on_done, NULL);
+	if (nworkers > 0 && curl_libevent_set_executor(evcurl, nworkers) == -1)
+		errx(1, "curl_libevent_set_executor");
+	if (pipe(donepipe) == -1)
+		err(1, "pipe");
+	event_set(&ev_done, donepipe[0], EV_READ, on_all_done, NULL);
+	event_add(&ev_done, NULL);
 
 	for (i = 0; i < argc; i++) {
 		curl = curl_easy_init();
 		curl_easy_setopt(curl, CURLOPT_URL, argv[i]);
 		curl_easy_setopt(curl, CURLOPT_PRIVATE, argv[i]);
 		curl_easy_setopt(curl, CURLOPT_WRITEDATA, fdevnull);
-		curl_libevent_perform(evcurl, curl, curl_on_done);
+		if (curl_libevent_perform_attr(evcurl, curl,
+		    (batch)? NULL : curl_on_done, &attr) == -1) {
+			printf("NG %s (queue is full)\n", argv[i]);
+			curl_easy_cleanup(curl);
+			continue;
+		}
 		ncurl++;
 	}
 
 	if (ncurl > 0)
 		event_loop(0);
+	curl_libevent_get_stats(evcurl, &stats);
+	if (coalesce)
+		printf("coalesced %llu\n", (unsigned long long)stats.coalesced);
+	if (attr.retry != NULL)
+		printf("retried %llu denied %llu\n",
+		    (unsigned long long)stats.retried,
+		    (unsigned long long)stats.retry_denied);
 
 	curl_libevent_destroy(evcurl);
+	event_del(&ev_done);
+	close(donepipe[0]);
+	close(donepipe[1]);
 	event_loop(0);	/* make sure no event is scheduled */
 
 	curl_global_cleanup();
@@ -68,17 +243,1377 @@ main(int argc, char *argv[])
 	exit(EXIT_SUCCESS);
 }
 
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: test [-bdm] [-c concurrency] [-q queuelen] "
+	    "[-r attempts] [-w workers]\n"
+	    "            url ...\n"
+	    "       test -t\n"
+	    "       test -a none | aimd | gradient\n"
+	    "       test -x events | complete\n");
+	exit(EXIT_FAILURE);
+}
+
 void
 curl_on_done(void *ctx, CURLMsg *msg)
 {
 	long	 rescode;
+	const struct curl_libevent_response
+		*resp;
+
 	if (msg->data.result == CURLE_OK) {
-		curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &rescode);
+		/* a coalesced request has the response of the leader */
+		if ((resp = curl_libevent_get_response(evcurl,
+		    msg->easy_handle)) != NULL)
+			rescode = resp->code;
+		else
+			curl_easy_getinfo(msg->easy_handle,
+			    CURLINFO_RESPONSE_CODE, &rescode);
 		printf("OK %-30.30s %03ld\n", (char *)ctx, rescode);
 	} else
 		printf("NG %s \n", (char *)ctx);
+	/* may be on a worker, event_loopbreak() is for the loop thread */
+	pthread_mutex_lock(&ncurl_mtx);
 	if (--ncurl <= 0)
+		write(donepipe[1], "", 1);
+	pthread_mutex_unlock(&ncurl_mtx);
+
+	/* through the loop if on a worker */
+	curl_libevent_easy_put(evcurl, msg->easy_handle);
+}
+
+void
+on_all_done(evutil_socket_t fd, short evmask, void *ctx)
+{
+	event_loopbreak();
+}
+
+void
+retry_reset(void *ctx, CURL *handle)
+{
+	/* nothing to discard, the body goes to /dev/null */
+}
+
+void
+batch_on_done(void *arg, const struct curl_libevent_completion *recs,
+    unsigned n)
+{
+	unsigned	 i;
+	long		 rescode;
+
+	printf("batch of %u\n", n);
+	for (i = 0; i < n; i++) {
+		if (recs[i].result == CURLE_OK) {
+			if (recs[i].response != NULL)
+				rescode = recs[i].response->code;
+			else
+				curl_easy_getinfo(recs[i].easy,
+				    CURLINFO_RESPONSE_CODE, &rescode);
+			printf("OK %-30.30s %03ld\n", (char *)recs[i].ctx,
+			    rescode);
+		} else
+			printf("NG %s \n", (char *)recs[i].ctx);
+		curl_easy_cleanup(recs[i].easy);
+	}
+	if ((ncurl -= n) <= 0)
+		event_loopbreak();
+}
+
+/*
+ * Self tests against a local origin.  Each test runs on a fresh instance
+ * and returns -1 if it failed.
+ */
+static const struct {
+	const char	 *name;
+	int		(*func)(struct event_base *);
+} selftests[] = {
+	{ "breaker",	breaker_test },
+	{ "cache",	cache_test },
+	{ "cancel",	cancel_test },
+	{ "coalesce",	coalesce_test },
+	{ "hedge",	hedge_test },
+	{ "mirror",	mirror_test },
+	{ "priority",	priority_test },
+	{ "rate",	rate_test },
+	{ "retry",	retry_test },
+	{ "shape",	shape_test },
+	{ "tenant",	tenant_test },
+};
+
+static int
+selftest(struct event_base *eb)
+{
+	struct curl_libevent	*saved = evcurl;
+	unsigned		 i;
+	int			 ret = 0, r;
+
+	for (i = 0; i < sizeof(selftests) / sizeof(selftests[0]); i++) {
+		evcurl = curl_libevent_create(eb);
+		if ((r = selftests[i].func(eb)) != 0)
+			ret = -1;
+		curl_libevent_destroy(evcurl);
+		printf("%-12s %s\n", selftests[i].name,
+		    (r == 0)? "PASSED" : "FAILED");
+	}
+	evcurl = saved;
+	printf("%s\n", (ret == 0)? "PASSED" : "FAILED");
+
+	return (ret);
+}
+
+/* Start an HTTP server on a port of 127.0.0.1 and tell its URL */
+static struct evhttp *
+origin_start(struct event_base *eb,
+    void (*cb)(struct evhttp_request *, void *), void *arg, char *url,
+    size_t urlsiz)
+{
+	struct evhttp		*http;
+	struct evhttp_bound_socket
+				*bound;
+	struct sockaddr_in	 sin;
+	socklen_t		 slen = sizeof(sin);
+
+	if ((http = evhttp_new(eb)) == NULL)
+		errx(1, "evhttp_new");
+	if ((bound = evhttp_bind_socket_with_handle(http, "127.0.0.1", 0))
+	    == NULL)
+		errx(1, "evhttp_bind_socket_with_handle");
+	if (getsockname(evhttp_bound_socket_get_fd(bound),
+	    (struct sockaddr *)&sin, &slen) == -1)
+		err(1, "getsockname");
+	evhttp_set_gencb(http, cb, arg);
+	snprintf(url, urlsiz, "http://127.0.0.1:%d/", ntohs(sin.sin_port));
+
+	return (http);
+}
+
+/*
+ * The origin of the self tests:
+ *   /ok	200 "ok"
+ *   /slow	200 "slow" after ST_SLOW_MS
+ *   /flaky	503 "error page" and 200 "real body" in turn
+ *   /fail	500
+ * The completions are recorded by the index given as CURLOPT_PRIVATE.
+ */
+#define ST_MAX		16
+#define ST_SLOW_MS	300
+#define ST_TIMEOUT	10	/* sec, for a test */
+
+struct st_result {
+	bool		 done;
+	CURLcode	 result;
+	long		 code;
+	char		 body[64];
+	size_t		 len;
+};
+
+static struct {
+	char		 url[64];
+	struct event_base
+			*eb;
+	unsigned	 origin_hits;
+	unsigned	 flaky;
+	unsigned	 hedge;
+	unsigned	 ndone;
+	unsigned	 nexpect;
+	int		 order[ST_MAX];	/* of the completions */
+	bool		 failed;
+	CURL		*handles[ST_MAX];
+	struct st_result res[ST_MAX];
+	struct event	 ev_timeout;
+} st;
+
+static void
+st_origin(struct evhttp_request *req, void *ctx)
+{
+	const char		*path = evhttp_request_get_uri(req);
+	struct timeval		 tv = { 0, ST_SLOW_MS * 1000 };
+	struct evbuffer		*buf;
+	int			 code = 200;
+	const char		*body = "ok";
+
+	st.origin_hits++;
+	if (strcmp(path, "/slow") == 0 ||
+	    (strcmp(path, "/hedge") == 0 && st.hedge++ == 0)) {
+		event_base_once(st.eb, -1, EV_TIMEOUT, st_origin_reply, req,
+		    &tv);
+		return;
+	} else if (strcmp(path, "/flaky") == 0) {
+		if (st.flaky++ % 2 == 0) {
+			code = 503;
+			body = "error page";
+		} else
+			body = "real body";
+	} else if (strcmp(path, "/fail") == 0) {
+		code = 500;
+		body = "";
+	}
+	buf = evbuffer_new();
+	evbuffer_add_printf(buf, "%s", body);
+	evhttp_send_reply(req, code, (code == 200)? "OK" : "Error", buf);
+	evbuffer_free(buf);
+}
+
+static void
+st_origin_reply(evutil_socket_t fd, short evmask, void *ctx)
+{
+	struct evhttp_request	*req = ctx;
+	struct evbuffer		*buf;
+
+	buf = evbuffer_new();
+	evbuffer_add_printf(buf, "slow");
+	evhttp_send_reply(req, 200, "OK", buf);
+	evbuffer_free(buf);
+}
+
+/* Perform a request to the path of the origin, recorded as idx */
+static CURL *
+st_perform(int idx, const char *path, const struct curl_libevent_attr *attr)
+{
+	CURL			*curl;
+	char			 url[128];
+
+	memset(&st.res[idx], 0, sizeof(st.res[idx]));
+	snprintf(url, sizeof(url), "%s%s", st.url, path);
+	curl = curl_easy_init();
+	curl_easy_setopt(curl, CURLOPT_URL, url);
+	curl_easy_setopt(curl, CURLOPT_PRIVATE, (void *)(intptr_t)idx);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, st_write);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &st.res[idx]);
+	if (curl_libevent_perform_attr(evcurl, curl, st_on_done, attr) == -1)
+		errx(1, "curl_libevent_perform_attr");
+	st.handles[idx] = curl;
+
+	return (curl);
+}
+
+static size_t
+st_write(char *ptr, size_t size, size_t nmemb, void *ctx)
+{
+	struct st_result	*res = ctx;
+	size_t			 len = size * nmemb;
+
+	if (res->len + len < sizeof(res->body)) {
+		memcpy(res->body + res->len, ptr, len);
+		res->len += len;
+	}
+
+	return (len);
+}
+
+static void
+st_on_done(void *ctx, CURLMsg *msg)
+{
+	struct st_result	*res = &st.res[(intptr_t)ctx];
+	const struct curl_libevent_response
+				*resp;
+
+	res->done = true;
+	res->result = msg->data.result;
+	if ((resp = curl_libevent_get_response(evcurl, msg->easy_handle))
+	    != NULL) {
+		/* buffered by the library, e.g. coalesced */
+		res->code = resp->code;
+		res->len = (resp->len < sizeof(res->body))? resp->len :
+		    sizeof(res->body) - 1;
+		memcpy(res->body, resp->data, res->len);
+	} else
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE,
+		    &res->code);
+	res->body[res->len] = '\0';
+	st.handles[(intptr_t)ctx] = NULL;
+	curl_easy_cleanup(msg->easy_handle);
+	if (st.ndone < ST_MAX)
+		st.order[st.ndone] = (intptr_t)ctx;
+	if (++st.ndone == st.nexpect)
+		event_base_loopbreak(st.eb);
+}
+
+static void
+st_on_timeout(evutil_socket_t fd, short evmask, void *ctx)
+{
+	printf("NG timed out, %u of %u done\n", st.ndone, st.nexpect);
+	st.failed = true;
+	event_base_loopbreak(st.eb);
+}
+
+/* Run the loop until n completions */
+static int
+st_run(struct event_base *eb, unsigned n)
+{
+	struct timeval		 tv = { ST_TIMEOUT, 0 };
+
+	st.nexpect = n;
+	if (st.ndone < n) {
+		evtimer_set(&st.ev_timeout, st_on_timeout, NULL);
+		event_base_set(eb, &st.ev_timeout);
+		evtimer_add(&st.ev_timeout, &tv);
+		event_base_dispatch(eb);
+		evtimer_del(&st.ev_timeout);
+	}
+
+	return ((st.failed)? -1 : 0);
+}
+
+static void
+st_expect(int idx, CURLcode result, long code, const char *body)
+{
+	struct st_result	*res = &st.res[idx];
+
+	if (!res->done || res->result != result ||
+	    (result == CURLE_OK && res->code != code) ||
+	    (body != NULL && strcmp(res->body, body) != 0)) {
+		printf("NG #%d: done %d result %d code %ld body \"%s\"\n",
+		    idx, res->done, res->result, res->code, res->body);
+		st.failed = true;
+	}
+}
+
+static struct evhttp *
+st_start(struct event_base *eb)
+{
+	struct evhttp		*http;
+
+	memset(&st, 0, sizeof(st));
+	st.eb = eb;
+	http = origin_start(eb, st_origin, NULL, st.url, sizeof(st.url));
+
+	return (http);
+}
+
+/*
+ * The origin answers the first "/hedge" after ST_SLOW_MS and the others
+ * at once, so the duplicate started after 50ms wins.
+ */
+static int
+hedge_test(struct event_base *eb)
+{
+	struct evhttp			*http;
+	struct curl_libevent_attr	 attr;
+	struct curl_libevent_stats	 stats;
+	struct timeval			 tv = { 0, ST_SLOW_MS * 1000 };
+
+	http = st_start(eb);
+	curl_libevent_set_hedge_budget(evcurl, 1.0);
+	curl_libevent_attr_init(&attr);
+	attr.hedge_ms = 50;
+	st_perform(0, "hedge", &attr);
+	st_run(eb, 1);
+	/* let the origin answer the loser */
+	event_base_loopexit(eb, &tv);
+	event_base_dispatch(eb);
+	evhttp_free(http);
+
+	st_expect(0, CURLE_OK, 200, "ok");
+	curl_libevent_get_stats(evcurl, &stats);
+	if (st.origin_hits != 2 || stats.hedged != 1 ||
+	    stats.hedge_wins != 1) {
+		printf("NG origin hits %u hedged %llu wins %llu\n",
+		    st.origin_hits, (unsigned long long)stats.hedged,
+		    (unsigned long long)stats.hedge_wins);
+		st.failed = true;
+	}
+
+	return ((st.failed)? -1 : 0);
+}
+
+/*
+ * The second mirror joins after the stagger and wins over the slow one,
+ * or at once when the first fails.  When all fail, on_done is called
+ * once with the failure.
+ */
+static int
+mirror_test(struct event_base *eb)
+{
+	struct evhttp			*http;
+	struct curl_libevent_stats	 stats;
+	struct timeval			 tv = { 0, ST_SLOW_MS * 1000 };
+	struct timeval			 start, end, elapsed;
+
+	http = st_start(eb);
+	mirror_test_perform(0, "slow", "ok", 50);
+	st_run(eb, 1);
+	evutil_gettimeofday(&start, NULL);
+	mirror_test_perform(1, "fail", "ok", 5000);
+	st_run(eb, 2);
+	evutil_gettimeofday(&end, NULL);
+	evutil_timersub(&end, &start, &elapsed);
+	mirror_test_perform(2, "fail", "fail", 0);
+	st_run(eb, 3);
+	/* let the origin answer the loser */
+	event_base_loopexit(eb, &tv);
+	event_base_dispatch(eb);
+	evhttp_free(http);
+
+	st_expect(0, CURLE_OK, 200, "ok");
+	st_expect(1, CURLE_OK, 200, "ok");
+	st_expect(2, CURLE_HTTP_RETURNED_ERROR, 0, NULL);
+	curl_libevent_get_stats(evcurl, &stats);
+	if (elapsed.tv_sec >= 1 || st.ndone != 3 || stats.mirrored != 3) {
+		printf("NG %ldms to fail over, %u done, mirrored %llu\n",
+		    (long)(elapsed.tv_sec * 1000 + elapsed.tv_usec / 1000),
+		    st.ndone, (unsigned long long)stats.mirrored);
+		st.failed = true;
+	}
+
+	return ((st.failed)? -1 : 0);
+}
+
+static void
+mirror_test_perform(int idx, const char *path0, const char *path1,
+    unsigned stagger_ms)
+{
+	CURL			*curl;
+	char			 urls[2][128];
+	const char		*urlv[2] = { urls[0], urls[1] };
+
+	memset(&st.res[idx], 0, sizeof(st.res[idx]));
+	snprintf(urls[0], sizeof(urls[0]), "%s%s", st.url, path0);
+	snprintf(urls[1], sizeof(urls[1]), "%s%s", st.url, path1);
+	curl = curl_easy_init();
+	curl_easy_setopt(curl, CURLOPT_PRIVATE, (void *)(intptr_t)idx);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, st_write);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &st.res[idx]);
+	curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+	if (curl_libevent_perform_mirrors(evcurl, curl, urlv, 2, stagger_ms,
+	    st_on_done, NULL) == -1)
+		errx(1, "curl_libevent_perform_mirrors");
+	st.handles[idx] = curl;
+}
+
+/*
+ * With one active slot, the queued transfers start by the priority class
+ * and in the order of the requests within a class.
+ */
+static int
+priority_test(struct event_base *eb)
+{
+	static const int		 prio[] = {
+		CURL_LIBEVENT_PRIO_NORMAL, CURL_LIBEVENT_PRIO_BULK,
+		CURL_LIBEVENT_PRIO_NORMAL, CURL_LIBEVENT_PRIO_INTERACTIVE,
+		CURL_LIBEVENT_PRIO_NORMAL
+	};
+	static const int		 order[] = { 0, 3, 2, 4, 1 };
+	struct evhttp			*http;
+	struct curl_libevent_attr	 attr;
+	int				 i;
+
+	http = st_start(eb);
+	curl_libevent_set_max_active(evcurl, 1);
+	curl_libevent_attr_init(&attr);
+	for (i = 0; i < 5; i++) {
+		attr.priority = prio[i];
+		st_perform(i, "ok", &attr);
+	}
+	st_run(eb, 5);
+	evhttp_free(http);
+
+	for (i = 0; i < 5; i++) {
+		st_expect(i, CURLE_OK, 200, "ok");
+		if (st.order[i] != order[i]) {
+			printf("NG #%d completed at %d\n", st.order[i], i);
+			st.failed = true;
+		}
+	}
+
+	return ((st.failed)? -1 : 0);
+}
+
+/*
+ * The default rate limit of 10/s and the burst 1 holds the second and the
+ * third requests to the host for 100ms each.  After the bucket is full
+ * again, a request to another key releases it, then the host starts with
+ * a new bucket.
+ */
+static int
+rate_test(struct event_base *eb)
+{
+	struct evhttp			*http;
+	struct curl_libevent_attr	 attr;
+	struct curl_libevent_stats	 stats;
+	struct timeval			 start, end, elapsed;
+	struct timeval			 tv = { 0, 150000 };
+	int				 i;
+
+	http = st_start(eb);
+	curl_libevent_set_rate_limit(evcurl, NULL, 10, 1);
+	curl_libevent_attr_init(&attr);
+	evutil_gettimeofday(&start, NULL);
+	for (i = 0; i < 3; i++)
+		st_perform(i, "ok", &attr);
+	st_run(eb, 3);
+	evutil_gettimeofday(&end, NULL);
+	evutil_timersub(&end, &start, &elapsed);
+	for (i = 0; i < 3; i++)
+		st_expect(i, CURLE_OK, 200, "ok");
+	curl_libevent_get_stats(evcurl, &stats);
+	if (stats.ratelimited != 2 || elapsed.tv_sec * 1000000 +
+	    elapsed.tv_usec < 180000) {
+		printf("NG %llu limited in %ldms\n",
+		    (unsigned long long)stats.ratelimited,
+		    (long)(elapsed.tv_sec * 1000 + elapsed.tv_usec / 1000));
+		st.failed = true;
+	}
+
+	event_base_loopexit(eb, &tv);
+	event_base_dispatch(eb);
+	attr.rate_key = "another";
+	st_perform(3, "ok", &attr);
+	attr.rate_key = NULL;
+	st_perform(4, "ok", &attr);
+	st_run(eb, 5);
+	evhttp_free(http);
+	st_expect(3, CURLE_OK, 200, "ok");
+	st_expect(4, CURLE_OK, 200, "ok");
+	curl_libevent_get_stats(evcurl, &stats);
+	if (stats.ratelimited != 2) {
+		printf("NG %llu limited\n",
+		    (unsigned long long)stats.ratelimited);
+		st.failed = true;
+	}
+
+	return ((st.failed)? -1 : 0);
+}
+
+/*
+ * Cancelling a queued transfer, and the active ones by the tag, completes
+ * them with CURLE_ABORTED_BY_CALLBACK and starts the queued one left.
+ */
+static int
+cancel_test(struct event_base *eb)
+{
+	struct evhttp			*http;
+	struct curl_libevent_attr	 attr;
+	struct curl_libevent_stats	 stats;
+	CURL				*curl;
+	int				 n;
+
+	http = st_start(eb);
+	curl_libevent_set_max_active(evcurl, 2);
+	curl_libevent_attr_init(&attr);
+	attr.tag = 1;
+	st_perform(0, "slow", &attr);
+	st_perform(1, "slow", &attr);
+	attr.tag = 2;
+	st_perform(2, "slow", &attr);
+	st_perform(3, "slow", NULL);
+	if (curl_libevent_cancel(evcurl, st.handles[3]) != 0)
+		st.failed = true;
+	if ((n = curl_libevent_cancel_tag(evcurl, 1)) != 2) {
+		printf("NG %d cancelled by the tag\n", n);
+		st.failed = true;
+	}
+	curl = curl_easy_init();
+	if (curl_libevent_cancel(evcurl, curl) != -1) {
+		printf("NG cancelled an unknown handle\n");
+		st.failed = true;
+	}
+	curl_easy_cleanup(curl);
+	st_run(eb, 4);
+	evhttp_free(http);
+
+	st_expect(0, CURLE_ABORTED_BY_CALLBACK, 0, NULL);
+	st_expect(1, CURLE_ABORTED_BY_CALLBACK, 0, NULL);
+	st_expect(2, CURLE_OK, 200, "slow");
+	st_expect(3, CURLE_ABORTED_BY_CALLBACK, 0, NULL);
+	curl_libevent_get_stats(evcurl, &stats);
+	if (stats.cancelled != 3) {
+		printf("NG %llu cancelled\n",
+		    (unsigned long long)stats.cancelled);
+		st.failed = true;
+	}
+
+	return ((st.failed)? -1 : 0);
+}
+
+/*
+ * With one active slot, the queued transfers of the tenants of weight 1
+ * and 3 are started by deficit round robin, and a tenant not configured
+ * is released after its transfers.
+ */
+static int
+tenant_test(struct event_base *eb)
+{
+	static const int		 order[] = { 0, 1, 4, 5, 6, 8, 2, 7, 3 };
+	struct evhttp			*http;
+	struct curl_libevent_attr	 attr;
+	struct curl_libevent_tenant_stats
+					 stats;
+	int				 i;
+
+	http = st_start(eb);
+	curl_libevent_set_max_active(evcurl, 1);
+	curl_libevent_set_tenant(evcurl, 1, 1, 0, 0);
+	curl_libevent_set_tenant(evcurl, 2, 3, 0, 0);
+	curl_libevent_attr_init(&attr);
+	for (i = 0; i < 9; i++) {
+		attr.tenant = (i < 4)? 1 : (i < 8)? 2 : 9;
+		st_perform(i, "ok", &attr);
+	}
+	if (curl_libevent_get_tenant_stats(evcurl, 9, &stats) != 0 ||
+	    stats.pending != 1) {
+		printf("NG tenant 9 is not queued\n");
+		st.failed = true;
+	}
+	st_run(eb, 9);
+	evhttp_free(http);
+
+	for (i = 0; i < 9; i++) {
+		st_expect(i, CURLE_OK, 200, "ok");
+		if (st.order[i] != order[i]) {
+			printf("NG #%d completed at %d\n", st.order[i], i);
+			st.failed = true;
+		}
+	}
+	if (curl_libevent_get_tenant_stats(evcurl, 1, &stats) != 0 ||
+	    stats.started != 4 || stats.waited != 3) {
+		printf("NG tenant 1 stats\n");
+		st.failed = true;
+	}
+	if (curl_libevent_get_tenant_stats(evcurl, 9, &stats) != -1) {
+		printf("NG tenant 9 is not released\n");
+		st.failed = true;
+	}
+
+	return ((st.failed)? -1 : 0);
+}
+
+/*
+ * Two failures open the breaker of the host and the next request fails
+ * fast.  The unused hosts beyond the limit are released by the last use
+ * while the open breaker is kept, and after open_ms a probe closes it.
+ */
+#define BT_HOSTS	300
+
+static int
+breaker_test(struct event_base *eb)
+{
+	struct evhttp			*http;
+	struct curl_libevent_breaker	 conf;
+	struct curl_libevent_breaker_stats
+					 stats;
+	struct curl_slist		*resolve = NULL;
+	struct timeval			 tv = { 2, 100000 };
+	char				 url[128], entry[128];
+	const char			*port;
+	CURL				*curl;
+	int				 i;
+
+	http = st_start(eb);
+	memset(&conf, 0, sizeof(conf));
+	conf.min_calls = 2;
+	conf.failure_pct = 50;
+	conf.open_ms = 2000;
+	conf.probes = 1;
+	curl_libevent_set_breaker(evcurl, &conf);
+	st_perform(0, "fail", NULL);
+	st_perform(1, "fail", NULL);
+	st_run(eb, 2);
+	st_perform(2, "ok", NULL);
+	st_run(eb, 3);
+	st_expect(0, CURLE_OK, 500, NULL);
+	st_expect(1, CURLE_OK, 500, NULL);
+	st_expect(2, CURL_LIBEVENT_E_CIRCUIT_OPEN, 0, NULL);
+	if (curl_libevent_get_breaker_stats(evcurl, "127.0.0.1", &stats) != 0
+	    || stats.state != CURL_LIBEVENT_BREAKER_OPEN ||
+	    st.origin_hits != 2) {
+		printf("NG the breaker is not open\n");
+		st.failed = true;
+	}
+
+	/* not to overflow the listen queue of the origin */
+	curl_libevent_set_max_active(evcurl, 16);
+	port = strrchr(st.url, ':') + 1;
+	for (i = 0; i < BT_HOSTS; i++) {
+		snprintf(entry, sizeof(entry), "h%d.test:%.*s:127.0.0.1", i,
+		    (int)strcspn(port, "/"), port);
+		resolve = curl_slist_append(resolve, entry);
+	}
+	for (i = 0; i < BT_HOSTS; i++) {
+		snprintf(url, sizeof(url), "http://h%d.test:%sok", i, port);
+		curl = curl_easy_init();
+		curl_easy_setopt(curl, CURLOPT_URL, url);
+		curl_easy_setopt(curl, CURLOPT_RESOLVE, resolve);
+		curl_easy_setopt(curl, CURLOPT_PRIVATE, (void *)(intptr_t)3);
+		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, st_write);
+		curl_easy_setopt(curl, CURLOPT_WRITEDATA, &st.res[3]);
+		if (curl_libevent_perform(evcurl, curl, st_on_done) == -1)
+			errx(1, "curl_libevent_perform");
+	}
+	st_run(eb, 3 + BT_HOSTS);
+	curl_slist_free_all(resolve);
+	if (curl_libevent_get_breaker_stats(evcurl, "h0.test", &stats) != -1
+	    || curl_libevent_get_breaker_stats(evcurl, "h299.test", &stats)
+	    != 0) {
+		printf("NG the unused hosts are not released\n");
+		st.failed = true;
+	}
+	if (curl_libevent_get_breaker_stats(evcurl, "127.0.0.1", &stats) != 0
+	    || stats.state != CURL_LIBEVENT_BREAKER_OPEN) {
+		printf("NG the open breaker is released\n");
+		st.failed = true;
+	}
+
+	event_base_loopexit(eb, &tv);
+	event_base_dispatch(eb);
+	st_perform(4, "ok", NULL);
+	st_run(eb, 4 + BT_HOSTS);
+	evhttp_free(http);
+	st_expect(4, CURLE_OK, 200, "ok");
+	if (curl_libevent_get_breaker_stats(evcurl, "127.0.0.1", &stats) != 0
+	    || stats.state != CURL_LIBEVENT_BREAKER_CLOSED) {
+		printf("NG the breaker is not closed\n");
+		st.failed = true;
+	}
+
+	return ((st.failed)? -1 : 0);
+}
+
+/*
+ * Coalesced waiters leave the flight when cancelled or expired, and the
+ * others get the response of the leader.  Another URL isn't coalesced,
+ * and the same one after the flight completes goes to the origin again.
+ */
+static int
+coalesce_test(struct event_base *eb)
+{
+	struct evhttp			*http;
+	struct curl_libevent_attr	 attr;
+	struct curl_libevent_stats	 stats;
+
+	http = st_start(eb);
+	curl_libevent_attr_init(&attr);
+	attr.coalesce_key = "GET";
+	st_perform(0, "slow", &attr);
+	st_perform(1, "slow", &attr);
+	st_perform(3, "slow", &attr);
+	st_perform(4, "ok", &attr);
+	attr.deadline_ms = 100;
+	st_perform(2, "slow", &attr);
+	curl_libevent_cancel(evcurl, st.handles[1]);
+	st_run(eb, 5);
+	attr.deadline_ms = 0;
+	st_perform(5, "slow", &attr);
+	st_run(eb, 6);
+	evhttp_free(http);
+
+	st_expect(0, CURLE_OK, 200, "slow");
+	st_expect(1, CURLE_ABORTED_BY_CALLBACK, 0, NULL);
+	st_expect(2, CURLE_OPERATION_TIMEDOUT, 0, NULL);
+	st_expect(3, CURLE_OK, 200, "slow");
+	st_expect(4, CURLE_OK, 200, "ok");
+	st_expect(5, CURLE_OK, 200, "slow");
+	curl_libevent_get_stats(evcurl, &stats);
+	if (st.origin_hits != 3 || stats.coalesced != 3) {
+		printf("NG origin hits %u coalesced %llu\n", st.origin_hits,
+		    (unsigned long long)stats.coalesced);
+		st.failed = true;
+	}
+
+	return ((st.failed)? -1 : 0);
+}
+
+/*
+ * A retry delivers only the body of the last attempt: with the reset
+ * callback, buffered by the library, and not retried without either.
+ */
+static int
+retry_test(struct event_base *eb)
+{
+	struct evhttp			*http;
+	struct curl_libevent_attr	 attr;
+	struct curl_libevent_retry	 retry;
+	struct curl_libevent_stats	 stats;
+
+	http = st_start(eb);
+	memset(&retry, 0, sizeof(retry));
+	retry.max_attempts = 3;
+	retry.classes = CURL_LIBEVENT_RETRY_DEFAULT;
+	retry.base_ms = 10;
+	retry.max_ms = 50;
+	curl_libevent_attr_init(&attr);
+	attr.retry = &retry;
+
+	retry.reset = retry_test_reset;
+	st_perform(0, "flaky", &attr);
+	st_run(eb, 1);
+	retry.reset = NULL;
+	attr.coalesce_key = "GET";
+	st_perform(1, "flaky", &attr);
+	st_run(eb, 2);
+	attr.coalesce_key = NULL;
+	st_perform(2, "flaky", &attr);
+	st_run(eb, 3);
+	evhttp_free(http);
+
+	st_expect(0, CURLE_OK, 200, "real body");
+	st_expect(1, CURLE_OK, 200, "real body");
+	st_expect(2, CURLE_OK, 503, "error page");
+	curl_libevent_get_stats(evcurl, &stats);
+	if (stats.retried != 2) {
+		printf("NG retried %llu\n", (unsigned long long)stats.retried);
+		st.failed = true;
+	}
+
+	return ((st.failed)? -1 : 0);
+}
+
+static void
+retry_test_reset(void *ctx, CURL *handle)
+{
+	st.res[(intptr_t)ctx].len = 0;
+}
+
+/*
+ * A shaped transfer gives the handle back with the write callback of the
+ * attribute, so it can be performed again without the shaper.
+ */
+static int
+shape_test(struct event_base *eb)
+{
+	struct evhttp			*http;
+	struct curl_libevent_attr	 attr;
+	struct curl_libevent_bandwidth_stats
+					 stats;
+	CURL				*curl;
+
+	http = st_start(eb);
+	curl_libevent_set_bandwidth(evcurl, 1000000, 1000000);
+	curl_libevent_attr_init(&attr);
+	attr.write_function = st_write;
+	attr.write_data = &st.res[0];
+	curl = curl_easy_init();
+	curl_easy_setopt(curl, CURLOPT_URL, st.url);
+	curl_easy_setopt(curl, CURLOPT_PRIVATE, (void *)0);
+	if (curl_libevent_perform_attr(evcurl, curl, shape_test_on_done,
+	    &attr) == -1)
+		errx(1, "curl_libevent_perform_attr");
+	st_run(eb, 2);
+	evhttp_free(http);
+
+	/* both bodies are written to the callback of the attribute */
+	st_expect(0, CURLE_OK, 200, "okok");
+	st_expect(1, CURLE_OK, 200, "");
+	curl_libevent_get_bandwidth_stats(evcurl, &stats);
+	if (stats.recv_bytes != 2) {
+		printf("NG shaped %llu bytes\n",
+		    (unsigned long long)stats.recv_bytes);
+		st.failed = true;
+	}
+
+	return ((st.failed)? -1 : 0);
+}
+
+static void
+shape_test_on_done(void *ctx, CURLMsg *msg)
+{
+	struct st_result	*res = &st.res[0];
+
+	res->done = true;
+	res->result = msg->data.result;
+	curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE,
+	    &res->code);
+	st.ndone++;
+	/* again without shaping */
+	curl_easy_setopt(msg->easy_handle, CURLOPT_PRIVATE, (void *)1);
+	if (curl_libevent_perform(evcurl, msg->easy_handle, st_on_done) == -1)
+		errx(1, "curl_libevent_perform");
+}
+
+/*
+ * Test of the cache with a local origin answering max-age=1 and an ETag:
+ * a miss, a hit, then a revalidation answered 304 after it gets stale.
+ */
+static struct {
+	char		 url[64];
+	int		 step;
+	int		 origin_hits;
+	bool		 failed;
+	struct event	 ev_timer;
+} ct;
+
+#define CACHE_TEST_BODY	"cached body"
+#define CACHE_TEST_ETAG	"\"v1\""
+
+static int
+cache_test(struct event_base *eb)
+{
+	struct evhttp		*http;
+	struct curl_libevent_cache_stats
+				 stats;
+
+	http = origin_start(eb, cache_test_origin, NULL, ct.url,
+	    sizeof(ct.url));
+	evtimer_set(&ct.ev_timer, cache_test_on_timer, NULL);
+	event_base_set(eb, &ct.ev_timer);
+
+	curl_libevent_set_cache(evcurl, 1024 * 1024);
+	cache_test_request();
+	event_base_dispatch(eb);
+	evhttp_free(http);
+
+	curl_libevent_get_cache_stats(evcurl, &stats);
+	printf("hits %llu misses %llu revalidations %llu not_modified %llu "
+	    "entries %u bytes %zu\n", (unsigned long long)stats.hits,
+	    (unsigned long long)stats.misses,
+	    (unsigned long long)stats.revalidations,
+	    (unsigned long long)stats.not_modified, stats.entries,
+	    stats.bytes);
+	if (ct.step != 3 || ct.origin_hits != 2 || stats.hits != 1 ||
+	    stats.misses != 2 || stats.revalidations != 1 ||
+	    stats.not_modified != 1 || stats.entries != 1)
+		ct.failed = true;
+
+	return ((ct.failed)? -1 : 0);
+}
+
+static void
+cache_test_origin(struct evhttp_request *req, void *ctx)
+{
+	struct evkeyvalq	*hdrs;
+	const char		*inm;
+	struct evbuffer		*buf;
+
+	ct.origin_hits++;
+	hdrs = evhttp_request_get_output_headers(req);
+	evhttp_add_header(hdrs, "Cache-Control", "max-age=1");
+	evhttp_add_header(hdrs, "ETag", CACHE_TEST_ETAG);
+	inm = evhttp_find_header(evhttp_request_get_input_headers(req),
+	    "If-None-Match");
+	if (inm != NULL && strcmp(inm, CACHE_TEST_ETAG) == 0) {
+		evhttp_send_reply(req, 304, "Not Modified", NULL);
+		return;
+	}
+	buf = evbuffer_new();
+	evbuffer_add_printf(buf, "%s", CACHE_TEST_BODY);
+	evhttp_send_reply(req, 200, "OK", buf);
+	evbuffer_free(buf);
+}
+
+static void
+cache_test_request(void)
+{
+	struct curl_libevent_attr	 attr;
+	CURL				*curl;
+
+	curl = curl_easy_init();
+	curl_easy_setopt(curl, CURLOPT_URL, ct.url);
+	curl_libevent_attr_init(&attr);
+	attr.cache_key = "GET";
+	if (curl_libevent_perform_attr(evcurl, curl, cache_test_on_done,
+	    &attr) == -1)
+		errx(1, "curl_libevent_perform_attr");
+}
+
+static void
+cache_test_on_done(void *ctx, CURLMsg *msg)
+{
+	const struct curl_libevent_response
+				*resp;
+	struct timeval		 tv = { 1, 100000 };
+	static const int	 origin_hits[] = { 1, 1, 2 };
+
+	resp = curl_libevent_get_response(evcurl, msg->easy_handle);
+	if (msg->data.result != CURLE_OK || resp == NULL ||
+	    resp->code != 200 || resp->len != strlen(CACHE_TEST_BODY) ||
+	    memcmp(resp->data, CACHE_TEST_BODY, resp->len) != 0 ||
+	    ct.origin_hits != origin_hits[ct.step]) {
+		printf("NG step %d\n", ct.step);
+		ct.failed = true;
+	}
+	curl_easy_cleanup(msg->easy_handle);
+	switch (++ct.step) {
+	case 1:
+		cache_test_request();	/* fresh */
+		break;
+	case 2:
+		evtimer_add(&ct.ev_timer, &tv);	/* get stale */
+		break;
+	default:
 		event_loopbreak();
+		break;
+	}
+}
+
+static void
+cache_test_on_timer(int fd, short evmask, void *ctx)
+{
+	cache_test_request();
+}
+
+/*
+ * Start an origin for the benchmarks in a child process, so that its
+ * system calls and CPU time are not counted in ours.  "/hang" is never
+ * answered.
+ */
+static pid_t
+bench_origin(char *url, size_t urlsiz)
+{
+	struct event_base	*eb;
+	int			 pipefd[2];
+	pid_t			 pid;
+
+	if (pipe(pipefd) == -1)
+		err(1, "pipe");
+	if ((pid = fork()) == -1)
+		err(1, "fork");
+	if (pid == 0) {
+		if ((eb = event_base_new()) == NULL)
+			errx(1, "event_base_new");
+		origin_start(eb, bench_origin_cb, NULL, url, urlsiz);
+		if (write(pipefd[1], url, urlsiz) != (ssize_t)urlsiz)
+			err(1, "write");
+		event_base_dispatch(eb);
+		_exit(0);
+	}
+	if (read(pipefd[0], url, urlsiz) != (ssize_t)urlsiz)
+		err(1, "read");
+	close(pipefd[0]);
+	close(pipefd[1]);
 
+	return (pid);
+}
+
+static void
+bench_origin_cb(struct evhttp_request *req, void *ctx)
+{
+	struct evbuffer		*buf;
+
+	if (strcmp(evhttp_request_get_uri(req), "/hang") == 0)
+		return;
+	buf = evbuffer_new();
+	evbuffer_add_printf(buf, "ok");
+	evhttp_send_reply(req, 200, "OK", buf);
+	evbuffer_free(buf);
+}
+
+/*
+ * Benchmark of the socket events: EB_CLIENTS clients request in a closed
+ * loop on keep-alive connections.  With the default epoll backend of
+ * libevent, an update of a socket event is an epoll_ctl(2).
+ */
+#define EB_CLIENTS	50
+#define EB_REQUESTS	20000
+
+static struct {
+	char		 url[64];
+	struct event_base
+			*eb;
+	unsigned	 started;
+	unsigned	 done;
+} eb_;
+
+static void
+events_bench(struct event_base *eb)
+{
+	struct curl_libevent_stats
+				 stats;
+	struct timeval		 start, end, elapsed;
+	double			 secs;
+	pid_t			 pid;
+	int			 i;
+
+	pid = bench_origin(eb_.url, sizeof(eb_.url));
+	eb_.eb = eb;
+	evutil_gettimeofday(&start, NULL);
+	for (i = 0; i < EB_CLIENTS; i++)
+		events_bench_request();
+	event_base_dispatch(eb);
+	evutil_gettimeofday(&end, NULL);
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+
+	evutil_timersub(&end, &start, &elapsed);
+	secs = elapsed.tv_sec + elapsed.tv_usec / 1e6;
+	curl_libevent_get_stats(evcurl, &stats);
+	printf("%u requests in %.2fs, %.0f req/s\n", eb_.done, secs,
+	    eb_.done / secs);
+	printf("socket callbacks %llu, event updates %llu (%.2f/req), "
+	    "%llu (%.2f/req) without skipping the unchanged\n",
+	    (unsigned long long)(stats.sock_updates + stats.sock_unchanged),
+	    (unsigned long long)stats.sock_updates,
+	    (double)stats.sock_updates / eb_.done,
+	    (unsigned long long)(stats.sock_updates +
+	    2 * stats.sock_unchanged),
+	    (double)(stats.sock_updates + 2 * stats.sock_unchanged) /
+	    eb_.done);
+}
+
+static void
+events_bench_request(void)
+{
+	CURL			*curl;
+
+	eb_.started++;
+	curl = curl_libevent_easy_get(evcurl);
+	curl_easy_setopt(curl, CURLOPT_URL, eb_.url);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, st_write);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &st.res[0]);
+	if (curl_libevent_perform(evcurl, curl, events_bench_on_done) == -1)
+		errx(1, "curl_libevent_perform");
+}
+
+static void
+events_bench_on_done(void *ctx, CURLMsg *msg)
+{
+	if (msg->data.result != CURLE_OK)
+		errx(1, "%s", curl_easy_strerror(msg->data.result));
+	curl_libevent_easy_put(evcurl, msg->easy_handle);
+	eb_.done++;
+	if (eb_.started < EB_REQUESTS)
+		events_bench_request();
+	else if (eb_.done == EB_REQUESTS)
+		event_base_loopbreak(eb_.eb);
+}
+
+/*
+ * Benchmark of the completions with many transfers in flight: CB_IDLE[i]
+ * transfers are connected and wait for "/hang", spread over the origins
+ * not to run out of the ports, while one client requests CB_REQUESTS in
+ * a closed loop to an origin of its own, since libcurl looks for a
+ * connection to reuse among all the connections to the host.  The time per request should not grow with the idle
+ * ones.  A size needing more descriptors than RLIMIT_NOFILE is skipped.
+ */
+#define CB_WARMUP	200
+#define CB_REQUESTS	5000
+#define CB_PER_ORIGIN	10000
+#define CB_ORIGINS	10
+
+static const unsigned CB_IDLE[] = { 100, 1000, 10000, 100000 };
+
+static struct {
+	char		 url[64];
+	char		 urls[CB_ORIGINS][64];
+	struct event_base
+			*eb;
+	unsigned	 idle;
+	unsigned	 connected;
+	unsigned	 started;
+	unsigned	 done;
+	struct timeval	 start;
+} cb;
+
+static void
+complete_bench(struct event_base *eb)
+{
+	struct curl_libevent	*saved = evcurl;
+	struct timeval		 end, elapsed;
+	struct rlimit		 rl;
+	struct rusage		 ru;
+	char			 hang[80];
+	CURL			*curl;
+	unsigned		 i, j;
+	pid_t			 pid, pids[CB_ORIGINS];
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == -1)
+		err(1, "getrlimit");
+	rl.rlim_cur = rl.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &rl) == -1)
+		err(1, "setrlimit");
+	pid = bench_origin(cb.url, sizeof(cb.url));
+	for (i = 0; i < CB_ORIGINS; i++)
+		pids[i] = bench_origin(cb.urls[i], sizeof(cb.urls[i]));
+	cb.eb = eb;
+
+	for (i = 0; i < sizeof(CB_IDLE) / sizeof(CB_IDLE[0]); i++) {
+		if (CB_IDLE[i] + 64 > rl.rlim_cur) {
+			printf("%6u in flight: skipped, RLIMIT_NOFILE is "
+			    "%llu\n", CB_IDLE[i],
+			    (unsigned long long)rl.rlim_cur);
+			continue;
+		}
+		evcurl = curl_libevent_create(eb);
+		cb.idle = CB_IDLE[i];
+		cb.connected = cb.started = cb.done = 0;
+		for (j = 0; j < cb.idle; j++) {
+			snprintf(hang, sizeof(hang), "%shang",
+			    cb.urls[j / CB_PER_ORIGIN]);
+			curl = curl_easy_init();
+			curl_easy_setopt(curl, CURLOPT_URL, hang);
+			curl_easy_setopt(curl, CURLOPT_PREREQFUNCTION,
+			    complete_bench_on_connect);
+			if (curl_libevent_perform(evcurl, curl,
+			    complete_bench_on_done) == -1)
+				errx(1, "curl_libevent_perform");
+		}
+		event_base_dispatch(eb);
+		evutil_gettimeofday(&end, NULL);
+		evutil_timersub(&end, &cb.start, &elapsed);
+		getrusage(RUSAGE_SELF, &ru);
+		printf("%6u in flight: %.1fus/req, maxrss %ldMB\n",
+		    cb.idle, (elapsed.tv_sec * 1e6 + elapsed.tv_usec) /
+		    (CB_REQUESTS - CB_WARMUP), ru.ru_maxrss / 1024);
+		curl_libevent_destroy(evcurl);
+	}
+	evcurl = saved;
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	for (i = 0; i < CB_ORIGINS; i++) {
+		kill(pids[i], SIGTERM);
+		waitpid(pids[i], NULL, 0);
+	}
+}
+
+/*
+ * Start the closed loop once all the idle ones have connected, out of the
+ * callback since libcurl can't be reentered here
+ */
+static int
+complete_bench_on_connect(void *ctx, char *conn_primary_ip,
+    char *conn_local_ip, int conn_primary_port, int conn_local_port)
+{
+	struct timeval		 tv = { 0, 0 };
+
+	if (++cb.connected == cb.idle)
+		event_base_once(cb.eb, -1, EV_TIMEOUT, complete_bench_start,
+		    NULL, &tv);
+
+	return (CURL_PREREQFUNC_OK);
+}
+
+static void
+complete_bench_start(evutil_socket_t fd, short evmask, void *ctx)
+{
+	complete_bench_request();
+}
+
+static void
+complete_bench_request(void)
+{
+	CURL			*curl;
+
+	cb.started++;
+	curl = curl_libevent_easy_get(evcurl);
+	curl_easy_setopt(curl, CURLOPT_URL, cb.url);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, st_write);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &st.res[0]);
+	if (curl_libevent_perform(evcurl, curl, complete_bench_on_done) == -1)
+		errx(1, "curl_libevent_perform");
+}
+
+static void
+complete_bench_on_done(void *ctx, CURLMsg *msg)
+{
+	if (msg->data.result != CURLE_OK)
+		errx(1, "%s", curl_easy_strerror(msg->data.result));
+	curl_libevent_easy_put(evcurl, msg->easy_handle);
+	if (++cb.done == CB_WARMUP)
+		evutil_gettimeofday(&cb.start, NULL);
+	if (cb.started < CB_REQUESTS)
+		complete_bench_request();
+	else
+		event_base_loopbreak(cb.eb);
+}
+
+/*
+ * Benchmark of the adaptive limit with a local origin serving
+ * LB_CAPACITY requests in LB_SERVICE_MS and sharing the time among the
+ * more, so the latency grows with the load beyond the capacity while the
+ * throughput doesn't.  LB_CLIENTS clients request in a closed loop.
+ */
+#define LB_CAPACITY	8
+#define LB_SERVICE_MS	10
+#define LB_CLIENTS	200
+#define LB_REQUESTS	4000
+
+static struct {
+	char		 url[64];
+	unsigned	 inflight;	/* in the origin */
+	unsigned	 started;
+	unsigned	 done;
+	uint64_t	 latency[LB_REQUESTS];	/* in usec */
+	struct timeval	 start;
+} lb;
+
+static void
+limit_bench(struct event_base *eb, int algo)
+{
+	struct evhttp		*http;
+	struct timeval		 end, elapsed;
+	double			 secs;
+	int			 i;
+
+	http = origin_start(eb, limit_bench_origin, eb, lb.url,
+	    sizeof(lb.url));
+
+	curl_libevent_set_adaptive_limit(evcurl, algo, 1, LB_CLIENTS);
+	evutil_gettimeofday(&lb.start, NULL);
+	for (i = 0; i < LB_CLIENTS; i++)
+		limit_bench_request();
+	event_base_dispatch(eb);
+	evutil_gettimeofday(&end, NULL);
+	evhttp_free(http);
+
+	evutil_timersub(&end, &lb.start, &elapsed);
+	secs = elapsed.tv_sec + elapsed.tv_usec / 1e6;
+	qsort(lb.latency, lb.done, sizeof(lb.latency[0]), limit_bench_cmp);
+	printf("%u requests in %.2fs, %.0f req/s, upstream latency "
+	    "p50 %.1fms p99 %.1fms, limit %u\n", lb.done, secs,
+	    lb.done / secs, lb.latency[lb.done / 2] / 1e3,
+	    lb.latency[lb.done * 99 / 100] / 1e3,
+	    curl_libevent_get_limit(evcurl, NULL));
+}
+
+static void
+limit_bench_origin(struct evhttp_request *req, void *ctx)
+{
+	struct event_base	*eb = ctx;
+	struct timeval		 tv;
+	unsigned		 msec;
+
+	lb.inflight++;
+	msec = LB_SERVICE_MS * ((lb.inflight > LB_CAPACITY)? lb.inflight :
+	    LB_CAPACITY) / LB_CAPACITY;
+	tv.tv_sec = msec / 1000;
+	tv.tv_usec = (msec % 1000) * 1000;
+	event_base_once(eb, -1, EV_TIMEOUT, limit_bench_reply, req, &tv);
+}
+
+static void
+limit_bench_reply(evutil_socket_t fd, short evmask, void *ctx)
+{
+	struct evhttp_request	*req = ctx;
+
+	lb.inflight--;
+	evhttp_send_reply(req, 200, "OK", NULL);
+}
+
+static void
+limit_bench_request(void)
+{
+	CURL			*curl;
+
+	lb.started++;
+	curl = curl_easy_init();
+	curl_easy_setopt(curl, CURLOPT_URL, lb.url);
+	if (curl_libevent_perform(evcurl, curl, limit_bench_on_done) == -1)
+		errx(1, "curl_libevent_perform");
+}
+
+static void
+limit_bench_on_done(void *ctx, CURLMsg *msg)
+{
+	curl_off_t		 usec = 0;
+
+	if (msg->data.result != CURLE_OK)
+		errx(1, "%s", curl_easy_strerror(msg->data.result));
+	curl_easy_getinfo(msg->easy_handle, CURLINFO_TOTAL_TIME_T, &usec);
+	lb.latency[lb.done++] = usec;
 	curl_easy_cleanup(msg->easy_handle);
+	if (lb.done % 500 == 0)
+		printf("%5u done, limit %u\n", lb.done,
+		    curl_libevent_get_limit(evcurl, NULL));
+	if (lb.started < LB_REQUESTS)
+		limit_bench_request();
+	else if (lb.done == LB_REQUESTS)
+		event_loopbreak();
+}
+
+static int
+limit_bench_cmp(const void *a, const void *b)
+{
+	uint64_t	 x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return ((x > y) - (x < y));
 }